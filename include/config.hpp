@@ -1,21 +1,31 @@
 #pragma once
 
-#include <SimpleKalmanFilter.h>
+#include <atomic>
+#include <FixedKalmanFilter.h>
+#include <CreepModel.h>
+#include <HampelFilter.h>
+#include <SpectrumEstimator.h>
+#include <BiquadNotch.h>
+#include <OffsetTable.h>
 #include "HX711.h"
 #include <MathBuffer.h>
+#include <ConcurrentBuffer.h>
+#include <TieredHistory.h>
 #include <AiEsp32RotaryEncoder.h>
 #include <Preferences.h>
-#include <MathBuffer.h>
 #include <SPI.h>
 #include <U8g2lib.h>
 
 // Declarations of global variables (no memory allocation here)
 extern Preferences preferences;       // Preferences object
 extern HX711 loadcell;                // HX711 load cell object
-extern SimpleKalmanFilter kalmanFilter; // Kalman filter for smoothing weight measurements
+extern FixedKalmanFilter kalmanFilter; // Kalman filter for smoothing weight measurements
 
 extern TaskHandle_t ScaleTask;        // Task handle for the scale task
 extern TaskHandle_t ScaleStatusTask;  // Task handle for the scale status task
+extern TaskHandle_t RotaryTask;       // Task handle for the rotary encoder task
+extern TaskHandle_t SettingsTask;     // Task handle for the settings writer task
+extern TaskHandle_t ShotLogTask;      // Task handle for the shot log writer task
 
 class MenuItem
 {
@@ -23,8 +33,8 @@ class MenuItem
         int id;
         bool selected;
         char menuName[16];
-        double increment;
-        double *value;
+        int32_t increment;
+        int32_t *value;
 };
 // Debug mode toggle
 #define DEBUG_MODE false;
@@ -40,35 +50,126 @@ extern bool debugMode;
 #define STATUS_GRINDING_FAILED 3
 #define STATUS_IN_MENU 4
 #define STATUS_IN_SUBMENU 5
+#define STATUS_TOPPING_UP 6
 #define STATUS_INFO_MENU 8
+#define STATUS_COUNT 9
+
+// What the grind state machine reacts to, as bit flags
+#define EVENT_SAMPLE 0x01  // a new reading was posted
+#define EVENT_TIMEOUT 0x02 // time went by, clocks and timers are checked on every step
+#define EVENT_BUTTON 0x04  // the grind button was held long enough
+#define EVENT_CUP 0x08     // the empty cup sat on the scale long enough
+#define EVENT_MENU 0x10    // a menu or the display asked for a status
+
+// Weights are handled as integer milligrams, grams only exist on screen and in NVS
+#define MG_PER_GRAM 1000
 
-#define CUP_WEIGHT 70
-#define CUP_DETECTION_TOLERANCE 5 // 5 grams tolerance above or bellow cup weight to detect it
+#define CUP_WEIGHT 70000
+#define CUP_DETECTION_TOLERANCE 5000 // 5 grams tolerance above or bellow cup weight to detect it
+#define CUP_SETTLE_MS 600 // how long the cup has to sit within tolerance before grinding starts
 
 #define LOADCELL_DOUT_PIN 3//19 - on esp32dev
 #define LOADCELL_SCK_PIN 2//18 - on esp32dev
 
 #define LOADCELL_SCALE_FACTOR 735.1
+#define LOADCELL_TIMEOUT_MS 300 // no conversion for this long means the HX711 is gone
+
+// Outlier stage ahead of the filter: single-sample spikes from the motor and relay
+#define HAMPEL_WINDOW 5 // readings the median is taken over
+#define HAMPEL_MIN_DEVIATION 300 // mg a reading must be off the median, at least, to be rejected
+
+// Vibration notch while grinding: the motor's line, aliased below half the sample rate
+#define VIBRATION_BLOCK 64 // readings per FFT, ~0.8 s at 80 SPS, redone every half block
+#define VIBRATION_MIN_BIN 4 // ignore lines below ~5 Hz at 80 SPS, that's the grind itself
+#define VIBRATION_PROMINENCE 10 // power a line needs over the mean of the other bins
+#define VIBRATION_MIN_AMPLITUDE 50 // mg, weaker lines are left to the weight filter
+#define NOTCH_POLE_RADIUS FIXED_Q16(0.9) // notch ~3 Hz wide at 80 SPS
+
+// Weight filter: smooth hard at rest, follow the weight while it moves or the grinder runs
+#define FILTER_MEASUREMENT_ERROR 20 // mg, noise of a single HX711 conversion
+#define FILTER_MOTION_THRESHOLD 150 // mg a reading has to be off the estimate to hint at motion
+#define FILTER_MOTION_SAMPLES 2 // consecutive readings off to the same side that confirm it
+#define FILTER_SETTLE_SAMPLES 8 // quiet readings before the weight counts as resting again
+#define FILTER_MOTION_ESTIMATE_ERROR 2000 // mg, gain of 0.99 while the weight moves
+#define FILTER_GRINDING_ESTIMATE_ERROR 20 // mg, gain of 0.5 while grinding
+#define FILTER_NOTCHED_ESTIMATE_ERROR 60 // mg, gain of 0.75 while grinding with the vibration notched out
+
+#define STATUS_IDLE_TIMEOUT_MS 50 // the grind state machine runs at least this often, even without readings
+
+#define RECORDING_SAMPLES 2400 // raw readings kept for the debug dump, 30 s at 80 SPS (~19 KB)
+#define RECORDING_EVENTS 64 // temperature readings and tares kept alongside them, a minute of temperatures
 
 #define TARE_MEASURES 20 // use the average of measure for taring
-#define SIGNIFICANT_WEIGHT_CHANGE 5 // 5 grams changes are used to detect a significant change
-#define COFFEE_DOSE_WEIGHT 18
-#define COFFEE_DOSE_OFFSET -2.5
+#define TARE_STABLE_SPREAD 300 // mg the readings may spread over TARE_MEASURES and still be tared from
+#define TARE_TIMEOUT_MS 3000 // how long a menu waits for the tare to land
+#define ZERO_TRACKING_RANGE 3000 // mg around zero within which the zero follows drift
+#define ZERO_TRACKING_SHIFT 9 // zero moves 1/512 of the way per reading (~6 s time constant at 80 SPS)
+
+#define TEMPERATURE_SAMPLE_MS 1000 // chip temperature is read once a second
+#define DRIFT_FORGETTING 0.9997 // per idle temperature reading, so the drift fit remembers ~1 h
+#define DRIFT_MIN_SAMPLES 300 // idle readings before the drift fit is trusted
+#define DRIFT_MIN_SPREAD 1.0 // degrees C the idle temperatures must spread (std dev) to fit a slope
+#define DRIFT_MAX_MG_PER_DEGREE 500 // anything steeper isn't temperature drift
+
+// Load cell creep: the reading keeps moving for seconds after a load lands
+#define CREEP_TIME_CONSTANT_MS 1500 // starting guess, learned per load cell after each shot
+#define GROUNDS_LANDING_MS 300 // margin past the learned stop delay before the grounds count as landed
+#define CREEP_FIT_MS 500 // settling watched before the final weight is predicted
+#define CREEP_LEARN_SPACING_MS 600 // spacing of the three averages the time constant is learned from
+#define CREEP_MAX_CORRECTION 2000 // mg a prediction may be off the current average before it's distrusted
+
+// Predictive stop: cut the motor once the weight plus what is still in flight reaches the target
+#define FLOW_WINDOW_MS 500 // the flow rate is the slope of the weight over this long
+#define STOP_DELAY_MS 0 // starting guess for the relay-to-plateau delay, learned after each shot
+#define STOP_DELAY_MAX_MS 2000
+#define FLOW_MIN_TO_LEARN 300 // mg/s, a slower shot says too little about the delay
+
+// Learned stop offsets by dose and grind duration, on top of the offset set in the menu
+#define OFFSET_TABLE_DOSES 8 // 8 g to 29 g in 3 g steps
+#define OFFSET_TABLE_FIRST_DOSE 8000
+#define OFFSET_TABLE_DOSE_STEP 3000
+#define OFFSET_TABLE_DURATIONS 4 // 4 s to 16 s grinds in 4 s steps
+#define OFFSET_TABLE_FIRST_DURATION 4000
+#define OFFSET_TABLE_DURATION_STEP 4000
+
+// Top-up mode: stop short of the dose, then pulse the grinder until it's there
+#define TOPUP_SHORTFALL 1000 // mg the main grind aims under the dose
+#define TOPUP_TOLERANCE 100 // mg under the dose that counts as there
+#define TOPUP_MAX_PULSES 5
+#define TOPUP_PULSE_MIN_MS 200 // shorter pulses don't get the motor going; never below RELAY_PRESS_MS + RELAY_RELEASE_GAP_MS, or the stop press waits
+#define TOPUP_PULSE_MAX_MS 1000
+#define TOPUP_PULSE_RATE 2000 // mg/s a pulse delivers, starting guess learned from each pulse
+#define TOPUP_PULSE_RATE_MIN 200
+#define TOPUP_PULSE_RATE_MAX 20000
+
+#define SIGNIFICANT_WEIGHT_CHANGE 5000 // 5 grams changes are used to detect a significant change
+#define COFFEE_DOSE_WEIGHT 18000
+#define COFFEE_DOSE_OFFSET -2500
 #define MAX_GRINDING_TIME 20000 // 20 seconds diff
-#define GRINDING_FAILED_WEIGHT_TO_RESET 150 // force on balance need to be measured to reset grinding
+#define GRINDING_FAILED_WEIGHT_TO_RESET 150000 // force on balance need to be measured to reset grinding
 
 #define GRINDER_ACTIVE_PIN 4// 33 - on esp32dev
+#define RELAY_PRESS_MS 100 // how long the grinder's button is held in impulse mode
+#define RELAY_RELEASE_GAP_MS 100 // the button stays up at least this long between two presses in impulse mode
+#define RELAY_STOP_HORIZON_MS 100 // stops predicted within this long are handed to the relay timer
 
 #define GRIND_BUTTON_PIN 20
 #define DEFAULT_GRIND_TRIGGER_MODE true  // true = use button, false = cup detection
 
-#define TARE_MIN_INTERVAL 10 * 1000 // auto-tare at most once every 10 seconds
-
 #define ROTARY_ENCODER_A_PIN 8//32 - on esp32dev
 #define ROTARY_ENCODER_B_PIN 9//23 - on esp32dev
 #define ROTARY_ENCODER_BUTTON_PIN 10//34 - on esp32dev
 #define ROTARY_ENCODER_VCC_PIN -1
 #define ROTARY_ENCODER_STEPS 4
+#define ROTARY_POLL_MS 50 // how often the encoder and its menus are looked at
+#define SETTINGS_WRITE_IDLE_MS 2000 // a changed setting goes to NVS once left alone this long
+#define SETTINGS_POLL_MS 250 // how often the settings writer looks for resting settings
+#define SHOT_CHECKPOINT_SHOTS 10 // shots counted in RTC memory between NVS writes, a power cut loses fewer than this
+#define SHOT_LOG_SLOTS 1024 // shots kept in flash before the oldest segment goes (~32 KB)
+#define SHOT_LOG_SEGMENT_SLOTS 64 // shots per segment file, the log drops this many at a time
+#define SHOT_LOG_INDEX_STRIDE 32 // every this many slots index the log when it is opened
+#define SHOT_LOG_PENDING 4 // shots the grind can hand over before the logger task has written them
+#define SETTINGS_VERSION 1 // layout of the stored settings blob, bump when StoredSettings changes
 
 // Screen 
 #define OLED_SDA 6//21 - on esp32dev
@@ -76,22 +177,31 @@ extern bool debugMode;
 
 // External User Variables
 extern volatile bool displayLock; // Add this declaration
-extern double scaleWeight;
+extern int32_t scaleWeight;
 extern unsigned long scaleLastUpdatedAt;
 extern unsigned long lastSignificantWeightChangeAt;
 extern unsigned long lastTareAt;
 extern bool scaleReady;
-extern int scaleStatus;
-extern double cupWeightEmpty;
+extern bool scaleMoving;
+extern uint32_t rejectedSamples;
+extern uint32_t vibrationFrequencyQ16;
+extern std::atomic<int> scaleStatus; // only the status task writes it, the menus go through setScaleStatus
+extern int32_t cupWeightEmpty;
 extern unsigned long startedGrindingAt;
 extern unsigned long finishedGrindingAt;
-extern double setWeight;
-extern double offset;
+extern int32_t setWeight;
+extern int32_t offset;
 extern bool scaleMode;
 extern bool grindMode;
+extern bool topUpMode;
 extern bool greset;
 extern int menuItemsCount;
-extern double setCupWeight;
+extern int32_t setCupWeight;
+// Full-rate samples (~3 s at 80 SPS) plus 1 minute of 1 s buckets and 1 hour of 1 min buckets (~18 KB)
+using WeightHistory = TieredHistory<int32_t, 256, 60, 60>;
+extern ConcurrentBuffer<WeightHistory> weightHistory; // Written by the scale task only
+using StopOffsetTable = OffsetTable<OFFSET_TABLE_DOSES, OFFSET_TABLE_DURATIONS>;
+extern StopOffsetTable offsetTable;
 extern MenuItem menuItems[];
 extern int currentMenuItem;
 extern int currentSetting;
@@ -100,4 +210,18 @@ extern bool screenJustWoke;
 extern unsigned int shotCount;
 extern int debugMenuItemsCount;
 extern int currentDebugMenuItem;
-extern bool useButtonToGrind;
\ No newline at end of file
+extern bool useButtonToGrind;
+extern int32_t mgPerCountQ16;
+extern double loadcellCountsPerGram;
+extern int32_t scaleZeroCounts;
+extern volatile bool tarePending;
+extern volatile bool grindSimulated;
+extern float driftCountsPerDegree;
+extern float referenceTemperature;
+extern CreepModel creepModel;
+extern uint32_t stopDelayMs;
+extern uint32_t pulseRateMgPerS;
+
+// Conversions for the display and NVS edges of the integer weight pipeline
+inline double mgToGrams(int32_t mg) { return (double)mg / MG_PER_GRAM; }
+inline int32_t gramsToMg(double grams) { return (int32_t)lround(grams * MG_PER_GRAM); }
@@ -5,10 +5,11 @@
 #include <U8g2lib.h>
 
 void setupDisplay();
-void showCupWeightSetScreen(double cupWeight);
+void showCupWeightSetScreen(int32_t cupWeight);
 void showInfoMenu();
 void wakeScreen();
 void showDebugModeStatus(bool debugMode);
 void showDebugMenu();
 void handleDebugMenuAction();
+void simulateGrinding();
 void showIpAddress();
\ No newline at end of file
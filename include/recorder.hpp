@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Methods
+void recordRawSample(int32_t counts, int64_t timestampUs);
+void recordTemperature(float celsius, int64_t timestampUs);
+size_t recordedSampleCount();
+void clearRecording();
+void dumpRecording();
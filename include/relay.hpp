@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+//Methods
+void setupRelay();
+void startGrinder();
+void stopGrinder();
+void scheduleGrinderStop(int64_t atUs);
+void cancelGrinderStop();
+bool isGrinderRunning();
+int64_t grinderStoppedAtUs();
+void reportGrinderSwitches();
@@ -4,6 +4,7 @@
 
 void rotary_onButtonClick();
 void rotary_loop();
+void updateRotary(void *parameter);
 void readEncoderISR();
 void exitToMenu();
 
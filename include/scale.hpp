@@ -1,5 +1,32 @@
 #pragma once
 
+#include <stdint.h>
+#include "config.hpp"
+
 //Methods
 void setupScale();
-void tareScale();
\ No newline at end of file
+void tareScale();
+bool waitForTare(unsigned long timeoutMs);
+void setScaleFactor(double countsPerGram);
+void processTemperatureReading(float celsius);
+int32_t zeroScaleReading(int32_t rawCounts, int64_t timestampUs);
+void restoreZeroState(int32_t zeroCounts, float countsPerDegree, float referenceCelsius, float celsius);
+void processScaleReading(int32_t counts, int64_t timestampUs);
+bool scaleStatusStep(uint8_t events = EVENT_SAMPLE);
+void setScaleStatus(int status);
+int32_t grindTargetMg();
+int32_t stopOffsetFor(int32_t doseMg, uint32_t grindMs);
+
+// One edge of the grind state machine, as taken since boot
+struct TransitionStats {
+    uint32_t count;
+    unsigned long lastAtMs;  // when it was taken last
+    uint8_t lastEvent;       // the EVENT_ flag that took it last
+    uint32_t lastLatencyUs;  // from the event to the transition being made
+    uint32_t worstLatencyUs;
+};
+
+const TransitionStats &transitionStats(int from, int to);
+void resetTransitionStats();
+bool worstTransition(int &from, int &to);
+void printTransitionStats();
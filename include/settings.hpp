@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.hpp"
+
+// Settings the menus change, cached in RAM and written back to NVS once they rest
+enum Setting {
+    SETTING_SET_WEIGHT,
+    SETTING_OFFSET,
+    SETTING_CUP_WEIGHT,
+    SETTING_SLEEP_TIME,
+    SETTING_SCALE_MODE,
+    SETTING_GRIND_MODE,
+    SETTING_GRIND_TRIGGER,
+    SETTING_TOP_UP,
+    SETTING_COUNT
+};
+
+// Everything the scale keeps in NVS, stored as one blob so a write lands whole or not at all
+struct __attribute__((packed)) StoredSettings {
+    uint16_t version;              // SETTINGS_VERSION when written
+    uint16_t size;                 // sizeof(StoredSettings) when written
+    double countsPerGram;          // load cell calibration
+    int32_t setWeight;             // mg
+    int32_t offset;                // mg
+    int32_t cupWeight;             // mg
+    int32_t sleepTime;             // ms
+    uint8_t scaleMode;
+    uint8_t grindMode;
+    uint8_t grindTrigger;
+    uint8_t topUp;
+    uint32_t shotCount;
+    double gramsPerDegreeDrift;
+    uint32_t creepTimeConstantMs;
+    uint32_t stopDelayMs;
+    uint32_t pulseRateMgPerS;
+    uint8_t offsetTable[StopOffsetTable::bytes()];
+    uint32_t crc;                  // CRC-32 of everything above
+};
+
+//Methods
+StoredSettings defaultSettings();
+bool loadSettings(StoredSettings &settings);
+void saveSettings();
+void settingChanged(Setting setting);
+bool writeRestingSettings();
+void settingLearned();
+void flushSettings();
+void checkpointSettings();
+void countShot();
+uint32_t recoverShotCount(uint32_t storedShotCount);
+void updateSettings(void *parameter);
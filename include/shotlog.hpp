@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// How a shot ended
+enum ShotResult : uint8_t {
+    SHOT_FINISHED,
+    SHOT_NO_WEIGHT,    // nothing on the scale when it should have been
+    SHOT_SCALE_LOST,   // the HX711 stopped answering
+    SHOT_TOO_LONG,     // ran into MAX_GRINDING_TIME
+    SHOT_STALLED,      // the weight stopped going up
+    SHOT_CUP_REMOVED,
+};
+
+// One shot, as kept in the log
+struct __attribute__((packed)) ShotRecord {
+    int32_t targetMg;    // the dose asked for
+    int32_t actualMg;    // what landed in the cup, as projected at the stop unless topped up
+    int32_t offsetMg;    // stop offset the grind stopped on, menu plus learned
+    uint32_t grindMs;
+    int32_t flowMgPerS;  // at the stop
+    int32_t cupMg;
+    uint8_t result;      // ShotResult
+};
+
+//Methods
+void setupShotLog();
+bool logShot(const ShotRecord &shot);
+size_t readShots(uint32_t firstSequence, ShotRecord *shots, size_t maxCount);
+uint32_t nextShotSequence();
+void printShotLog(size_t count);
+void updateShotLog(void *parameter);
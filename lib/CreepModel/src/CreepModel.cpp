@@ -0,0 +1,40 @@
+#include "CreepModel.h"
+
+CreepModel::CreepModel(uint32_t timeConstantMs) : timeConstantMs(1) {
+  setTimeConstant(timeConstantMs);
+}
+
+bool CreepModel::learn(int32_t early, int32_t middle, int32_t late, uint32_t spacingMs) {
+  int32_t firstChange = middle - early;
+  int32_t secondChange = late - middle;
+  if (firstChange > -MIN_LEARN_CHANGE && firstChange < MIN_LEARN_CHANGE) {
+    return false;
+  }
+
+  // Each spacing shrinks what's left to settle by exp(-spacing / tau)
+  float ratio = (float)secondChange / firstChange;
+  if (ratio <= 0.02f || ratio >= 0.98f) {
+    return false;
+  }
+  float observed = -(float)spacingMs / logf(ratio);
+  if (observed < MIN_TIME_CONSTANT_MS || observed > MAX_TIME_CONSTANT_MS) {
+    return false;
+  }
+
+  // One settle is noisy, move a quarter of the way
+  timeConstantMs += (observed - timeConstantMs) / 4;
+  return true;
+}
+
+uint32_t CreepModel::getTimeConstant() const {
+  return (uint32_t)lroundf(timeConstantMs);
+}
+
+void CreepModel::setTimeConstant(uint32_t timeConstantMs) {
+  if (timeConstantMs < MIN_TIME_CONSTANT_MS) {
+    timeConstantMs = MIN_TIME_CONSTANT_MS;
+  } else if (timeConstantMs > MAX_TIME_CONSTANT_MS) {
+    timeConstantMs = MAX_TIME_CONSTANT_MS;
+  }
+  this->timeConstantMs = (float)timeConstantMs;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+
+// Load cell creep after a load step, modelled as exponential settling:
+//   weight(t) = settled - amplitude * exp(-(t - step) / timeConstant)
+// The time constant is a property of the load cell, learned from full settles;
+// with it fixed, settled and amplitude follow from a linear least-squares fit,
+// so the final reading can be predicted long before it is reached.
+class CreepModel {
+public:
+	CreepModel(uint32_t timeConstantMs);
+
+	// Fits the samples in [first, last) (MathBuffer iterators, or anything with
+	// operator* and timestamp() in ms). The step time only scales the amplitude,
+	// any time at or before the first sample works. False when the samples are
+	// too few or too close together in time to tell creep from noise.
+	template<typename It> bool predictSettled(It first, It last, int64_t stepAtMs, int32_t &settled) const;
+
+	// Learns the time constant from three averages taken spacingMs apart along
+	// one settle. Returns false and keeps the old value when the averages don't
+	// look like a decaying exponential.
+	bool learn(int32_t early, int32_t middle, int32_t late, uint32_t spacingMs);
+
+	uint32_t getTimeConstant() const;
+	void setTimeConstant(uint32_t timeConstantMs);
+
+	static constexpr uint32_t MIN_TIME_CONSTANT_MS = 100;
+	static constexpr uint32_t MAX_TIME_CONSTANT_MS = 20000;
+	static constexpr int32_t MIN_LEARN_CHANGE = 20; // smallest step between averages worth learning from
+	static constexpr size_t MIN_SAMPLES = 8;
+
+private:
+	float timeConstantMs;
+};
+
+#include "CreepModel.tpp"
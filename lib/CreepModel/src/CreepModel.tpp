@@ -0,0 +1,33 @@
+#include "CreepModel.h"
+
+template<typename It>
+bool CreepModel::predictSettled(It first, It last, int64_t stepAtMs, int32_t &settled) const {
+  if (first == last) {
+    return false;
+  }
+
+  // weight = settled + slope * decay, solved as a straight line in decay.
+  // Weights are taken relative to the first sample to keep the sums small.
+  int32_t origin = *first;
+  double n = 0, sumDecay = 0, sumDecaySquared = 0, sumWeight = 0, sumDecayWeight = 0;
+  for (It it = first; it != last; ++it) {
+    double decay = exp(-(double)(it.timestamp() - stepAtMs) / timeConstantMs);
+    double weight = (double)(*it - origin);
+    n += 1;
+    sumDecay += decay;
+    sumDecaySquared += decay * decay;
+    sumWeight += weight;
+    sumDecayWeight += decay * weight;
+  }
+  if (n < MIN_SAMPLES) {
+    return false;
+  }
+
+  double determinant = n * sumDecaySquared - sumDecay * sumDecay;
+  // Decay values that barely differ would extrapolate the noise, not the creep
+  if (determinant <= n * n * 1e-4) {
+    return false;
+  }
+  settled = origin + (int32_t)lround((sumDecaySquared * sumWeight - sumDecay * sumDecayWeight) / determinant);
+  return true;
+}
@@ -0,0 +1,68 @@
+#include "FixedKalmanFilter.h"
+
+FixedKalmanFilter::FixedKalmanFilter(int32_t measurementError, int32_t estimateError, uint32_t processNoiseQ16) :
+		errMeasure((int64_t)measurementError << ESTIMATE_FRACTION_BITS),
+		errEstimate((int64_t)estimateError << ESTIMATE_FRACTION_BITS), minErrEstimate(1),
+		q(processNoiseQ16), kalmanGain(0), currentEstimate(0), initialized(false) {
+}
+
+int32_t FixedKalmanFilter::updateEstimate(int32_t measurement) {
+  int64_t scaledMeasurement = (int64_t)measurement << ESTIMATE_FRACTION_BITS;
+  if (!initialized) {
+    // Start from the first reading instead of ramping up from zero
+    currentEstimate = scaledMeasurement;
+    initialized = true;
+  }
+
+  if (errEstimate < minErrEstimate) {
+    errEstimate = minErrEstimate;
+  }
+  int64_t total = errEstimate + errMeasure;
+  kalmanGain = total > 0 ? (uint32_t)((errEstimate << 16) / total) : 0;
+
+  int64_t lastEstimate = currentEstimate;
+  currentEstimate += ((scaledMeasurement - currentEstimate) * kalmanGain) >> 16;
+
+  int64_t change = currentEstimate - lastEstimate;
+  if (change < 0) {
+    change = -change;
+  }
+  errEstimate = ((errEstimate * (65536 - kalmanGain)) >> 16) + ((change * q) >> 16);
+  if (errEstimate < 1) {
+    // A zero error estimate would freeze the filter for good, the float version never quite gets there
+    errEstimate = 1;
+  }
+
+  return getEstimate();
+}
+
+void FixedKalmanFilter::setEstimate(int32_t estimate) {
+  currentEstimate = (int64_t)estimate << ESTIMATE_FRACTION_BITS;
+  initialized = true;
+}
+
+void FixedKalmanFilter::setMeasurementError(int32_t measurementError) {
+  errMeasure = (int64_t)measurementError << ESTIMATE_FRACTION_BITS;
+}
+
+void FixedKalmanFilter::setEstimateError(int32_t estimateError) {
+  errEstimate = (int64_t)estimateError << ESTIMATE_FRACTION_BITS;
+}
+
+void FixedKalmanFilter::setProcessNoise(uint32_t processNoiseQ16) {
+  q = processNoiseQ16;
+}
+
+void FixedKalmanFilter::setMinimumEstimateError(int32_t estimateError) {
+  // Never below one fractional step, a zero error estimate would freeze the filter
+  minErrEstimate = estimateError > 0 ? (int64_t)estimateError << ESTIMATE_FRACTION_BITS : 1;
+}
+
+int32_t FixedKalmanFilter::getEstimate() const {
+  // Round to nearest rather than towards negative infinity
+  return (int32_t)((currentEstimate + (1 << (ESTIMATE_FRACTION_BITS - 1))) >> ESTIMATE_FRACTION_BITS);
+}
+
+uint32_t FixedKalmanFilter::getKalmanGain() const {
+  return kalmanGain;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+
+// Converts a real constant to Q16 at compile time
+#define FIXED_Q16(x) ((uint32_t)((x) * 65536.0 + 0.5))
+
+// Integer-only port of SimpleKalmanFilter for targets without an FPU.
+// Measurements and estimates are in the caller's integer unit (e.g. mg);
+// the error terms keep ESTIMATE_FRACTION_BITS extra bits so that a quiet
+// signal does not truncate the gain to zero.
+class FixedKalmanFilter {
+public:
+	static constexpr int ESTIMATE_FRACTION_BITS = 8;
+
+	FixedKalmanFilter(int32_t measurementError, int32_t estimateError, uint32_t processNoiseQ16);
+
+	int32_t updateEstimate(int32_t measurement);
+	void setEstimate(int32_t estimate);
+	void setMeasurementError(int32_t measurementError);
+	void setEstimateError(int32_t estimateError);
+	void setProcessNoise(uint32_t processNoiseQ16);
+	// Keeps the error estimate from settling below this, which holds the gain at
+	// or above minimum / (minimum + measurement error) while the signal is known to move
+	void setMinimumEstimateError(int32_t estimateError);
+	int32_t getEstimate() const;
+	uint32_t getKalmanGain() const; // Q16
+
+private:
+	int64_t errMeasure;
+	int64_t errEstimate;
+	int64_t minErrEstimate;
+	uint32_t q;
+	uint32_t kalmanGain;
+	int64_t currentEstimate;
+	bool initialized;
+};
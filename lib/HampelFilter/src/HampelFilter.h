@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <type_traits>
+
+// Streaming Hampel identifier over the last W samples (W odd). A sample further
+// from the window median than `sigmas` robust standard deviations (1.4826 * MAD),
+// and at least minDeviation, is an outlier and is replaced by the median.
+// Only maxConsecutive outliers in a row are replaced, so a real step gets
+// through after that many samples instead of being held back by the window.
+// Each sample costs O(W): one insertion into a sorted copy of the window
+// and one merge pass for the MAD.
+template<typename T, size_t W> class HampelFilter {
+public:
+	static_assert(W % 2 == 1 && W >= 3, "window must be odd and at least 3");
+
+	HampelFilter(T minDeviation, uint8_t sigmas = 3, uint8_t maxConsecutive = 1);
+
+	// Returns the sample, or the window median if it was rejected
+	T filter(T value);
+
+	// Forgets the window, e.g. after the zero moved under it
+	void reset() { head = 0; count = 0; consecutive = 0; }
+
+	bool lastRejected() const { return consecutive > 0; }
+	uint32_t rejectedCount() const { return rejected; }
+	void resetRejectedCount() { rejected = 0; }
+
+private:
+	// Integer samples keep the threshold in integer math
+	using Wide = typename std::conditional<std::is_floating_point<T>::value, double, int64_t>::type;
+
+	T median() const { return sorted[W / 2]; }
+	T medianAbsoluteDeviation() const;
+
+	T window[W]; // arrival order
+	T sorted[W];
+	size_t head;
+	size_t count;
+
+	T minDeviation;
+	uint8_t sigmas;
+	uint8_t maxConsecutive;
+	uint8_t consecutive;
+	uint32_t rejected;
+};
+
+#include "HampelFilter.tpp"
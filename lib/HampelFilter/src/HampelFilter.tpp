@@ -0,0 +1,75 @@
+#include "HampelFilter.h"
+
+template<typename T, size_t W>
+HampelFilter<T, W>::HampelFilter(T minDeviation, uint8_t sigmas, uint8_t maxConsecutive) :
+		head(0), count(0), minDeviation(minDeviation), sigmas(sigmas), maxConsecutive(maxConsecutive),
+		consecutive(0), rejected(0) {
+  static_assert(std::is_arithmetic<T>::value, "T must be numeric");
+}
+
+template<typename T, size_t W>
+T HampelFilter<T, W>::filter(T value) {
+  // Swap the oldest sample for the new one in the sorted copy
+  size_t position;
+  if (count == W) {
+    T oldest = window[head];
+    position = 0;
+    while (sorted[position] != oldest) {
+      position++;
+    }
+    for (; position + 1 < W; position++) {
+      sorted[position] = sorted[position + 1];
+    }
+  } else {
+    count++;
+  }
+  window[head] = value;
+  head = (head + 1) % W;
+
+  position = count - 1;
+  while (position > 0 && sorted[position - 1] > value) {
+    sorted[position] = sorted[position - 1];
+    position--;
+  }
+  sorted[position] = value;
+
+  if (count < W) {
+    return value;
+  }
+
+  T center = median();
+  T deviation = value > center ? value - center : center - value;
+  // 1.4826 * MAD estimates the standard deviation of normal noise, in Q16
+  Wide threshold = (Wide)medianAbsoluteDeviation() * sigmas * 97163 / 65536;
+  if (threshold < (Wide)minDeviation) {
+    threshold = (Wide)minDeviation;
+  }
+
+  if ((Wide)deviation > threshold && consecutive < maxConsecutive) {
+    consecutive++;
+    rejected++;
+    return center;
+  }
+  consecutive = 0;
+  return value;
+}
+
+template<typename T, size_t W>
+T HampelFilter<T, W>::medianAbsoluteDeviation() const {
+  // Deviations grow walking outwards from the median on either side, so the
+  // middle one is found by merging the two runs
+  size_t left = W / 2;
+  size_t right = W / 2 + 1;
+  T center = median();
+  T current = 0; // the median's own deviation
+  for (size_t taken = 1; taken <= W / 2; taken++) {
+    bool hasLeft = left > 0;
+    bool hasRight = right < W;
+    if (hasLeft && (!hasRight || center - sorted[left - 1] <= sorted[right] - center)) {
+      current = center - sorted[--left];
+    } else {
+      current = sorted[right++] - center;
+    }
+  }
+  return current;
+}
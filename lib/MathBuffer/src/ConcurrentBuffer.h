@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <Arduino.h>
+#include <atomic>
+#include <utility>
+#include "MathBuffer.h"
+
+// Single-producer / multi-consumer wrapper that publishes a history buffer
+// through a sequence counter (seqlock). The writer never blocks; readers run
+// their query against the live buffer and retry if a write overlapped it, so
+// every result comes from one consistent snapshot.
+//
+// Queries passed to read() may run more than once and must return values,
+// never iterators or references into the buffer.
+template<typename B> class ConcurrentBuffer {
+public:
+	using value_type = typename B::value_type;
+	static constexpr size_t capacity = B::capacity;
+
+	ConcurrentBuffer() : sequence(0) {}
+
+	// Only ever call from the single producer task
+	template<typename F> void write(F update);
+	template<typename F> auto read(F query) const -> decltype(query(std::declval<const B&>()));
+
+	bool push(value_type value);
+	bool push(value_type value, int64_t timestampUs);
+
+	size_t countSamplesSince(int64_t cutoffMs) const;
+	value_type averageSince(int64_t cutoffMs) const;
+	value_type maxSince(int64_t cutoffMs) const;
+	value_type minSince(int64_t cutoffMs) const;
+	value_type firstValueOlderThan(int64_t cutoffMs) const;
+
+private:
+	B buffer;
+	std::atomic<uint32_t> sequence; // odd while a write is in progress
+};
+
+template<typename T, size_t S> using ConcurrentMathBuffer = ConcurrentBuffer<MathBuffer<T, S>>;
+
+#include "ConcurrentBuffer.tpp"
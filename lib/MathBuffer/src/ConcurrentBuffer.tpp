@@ -0,0 +1,72 @@
+#include "ConcurrentBuffer.h"
+
+template<typename B>
+template<typename F>
+void ConcurrentBuffer<B>::write(F update) {
+  uint32_t current = sequence.load(std::memory_order_relaxed);
+  sequence.store(current + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  update(buffer);
+
+  sequence.store(current + 2, std::memory_order_release);
+}
+
+template<typename B>
+template<typename F>
+auto ConcurrentBuffer<B>::read(F query) const -> decltype(query(std::declval<const B&>())) {
+  for (;;) {
+    uint32_t before = sequence.load(std::memory_order_acquire);
+    if (before & 1) {
+      // The producer was preempted mid-write, give it the CPU back
+      delay(1);
+      continue;
+    }
+
+    auto result = query(buffer);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence.load(std::memory_order_relaxed) == before) {
+      return result;
+    }
+  }
+}
+
+template<typename B>
+bool ConcurrentBuffer<B>::push(value_type value) {
+  bool full = false;
+  write([&full, value](B &b) { full = b.push(value); });
+  return full;
+}
+
+template<typename B>
+bool ConcurrentBuffer<B>::push(value_type value, int64_t timestampUs) {
+  bool full = false;
+  write([&full, value, timestampUs](B &b) { full = b.push(value, timestampUs); });
+  return full;
+}
+
+template<typename B>
+size_t ConcurrentBuffer<B>::countSamplesSince(int64_t cutoffMs) const {
+  return read([cutoffMs](const B &b) { return b.countSamplesSince(cutoffMs); });
+}
+
+template<typename B>
+typename ConcurrentBuffer<B>::value_type ConcurrentBuffer<B>::averageSince(int64_t cutoffMs) const {
+  return read([cutoffMs](const B &b) { return b.averageSince(cutoffMs); });
+}
+
+template<typename B>
+typename ConcurrentBuffer<B>::value_type ConcurrentBuffer<B>::maxSince(int64_t cutoffMs) const {
+  return read([cutoffMs](const B &b) { return b.maxSince(cutoffMs); });
+}
+
+template<typename B>
+typename ConcurrentBuffer<B>::value_type ConcurrentBuffer<B>::minSince(int64_t cutoffMs) const {
+  return read([cutoffMs](const B &b) { return b.minSince(cutoffMs); });
+}
+
+template<typename B>
+typename ConcurrentBuffer<B>::value_type ConcurrentBuffer<B>::firstValueOlderThan(int64_t cutoffMs) const {
+  return read([cutoffMs](const B &b) { return b.firstValueOlderThan(cutoffMs); });
+}
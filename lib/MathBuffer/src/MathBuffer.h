@@ -3,26 +3,123 @@
 #include <stddef.h>
 #include <Arduino.h>
 #include <type_traits>
+#include <iterator>
 
 template<typename T, size_t S> class MathBuffer {
 public:
 	constexpr MathBuffer();
 
 	static constexpr size_t capacity = S;
+	using value_type = T;
 
+	// Wide type used for the running sum so integer samples can't overflow it
+	using Accumulator = typename std::conditional<std::is_floating_point<T>::value, double, int64_t>::type;
+
+	// Random-access iterator over samples in push order (oldest first).
+	// Invalidated by push().
+	class const_iterator {
+	public:
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type = T;
+		using difference_type = ptrdiff_t;
+		using pointer = const T*;
+		using reference = const T&;
+
+		const_iterator() : owner(nullptr), position(0) {}
+		const_iterator(const MathBuffer *owner, size_t position) : owner(owner), position(position) {}
+
+		reference operator*() const { return owner->buffer[owner->slotAt(position)]; }
+		pointer operator->() const { return &**this; }
+		reference operator[](difference_type n) const { return *(*this + n); }
+		int64_t timestampUs() const { return owner->timestampAt(owner->slotAt(position)); }
+		int64_t timestamp() const { return timestampUs() / 1000; } // ms
+
+		const_iterator &operator++() { position += 1; return *this; }
+		const_iterator operator++(int) { const_iterator previous = *this; position += 1; return previous; }
+		const_iterator &operator--() { position -= 1; return *this; }
+		const_iterator operator--(int) { const_iterator previous = *this; position -= 1; return previous; }
+		const_iterator &operator+=(difference_type n) { position += n; return *this; }
+		const_iterator &operator-=(difference_type n) { position -= n; return *this; }
+		const_iterator operator+(difference_type n) const { return const_iterator(owner, position + n); }
+		const_iterator operator-(difference_type n) const { return const_iterator(owner, position - n); }
+		friend const_iterator operator+(difference_type n, const const_iterator &it) { return it + n; }
+		difference_type operator-(const const_iterator &other) const { return (difference_type)position - (difference_type)other.position; }
+
+		bool operator==(const const_iterator &other) const { return position == other.position; }
+		bool operator!=(const const_iterator &other) const { return position != other.position; }
+		bool operator<(const const_iterator &other) const { return position < other.position; }
+		bool operator>(const const_iterator &other) const { return position > other.position; }
+		bool operator<=(const const_iterator &other) const { return position <= other.position; }
+		bool operator>=(const const_iterator &other) const { return position >= other.position; }
+
+	private:
+		const MathBuffer *owner;
+		size_t position;
+	};
+	using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+	// The samples taken at or after a cutoff, usable with <algorithm>
+	struct Window {
+		const_iterator first, last;
+
+		const_iterator begin() const { return first; }
+		const_iterator end() const { return last; }
+		const_reverse_iterator rbegin() const { return const_reverse_iterator(last); }
+		const_reverse_iterator rend() const { return const_reverse_iterator(first); }
+		size_t size() const { return last - first; }
+		bool empty() const { return first == last; }
+	};
+
+	// Stamps the sample with the current time
 	bool push(T value);
+	// Stamps the sample with when it was actually taken; timestamps must not decrease
+	bool push(T value, int64_t timestampUs);
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, count); }
+	const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+	const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+	size_t size() const { return count; }
+
+	Window since(int64_t cutoffMs) const;
 
-	void executeOnSamplesSince(int64_t cutoffMs, std::function<void (T, int64_t)> iterator);
-	size_t countSamplesSince(int64_t cutoffMs);
-	T averageSince(int64_t cutoffMs);
-	T maxSince(int64_t cutoffMs);
-	T minSince(int64_t cutoffMs);
-	T firstValueOlderThan(int64_t cutoffMs);
+	void executeOnSamplesSince(int64_t cutoffMs, std::function<void (T, int64_t)> iterator) const;
+	size_t countSamplesSince(int64_t cutoffMs) const;
+	Accumulator sumSince(int64_t cutoffMs) const;
+	T averageSince(int64_t cutoffMs) const;
+	T maxSince(int64_t cutoffMs) const;
+	T minSince(int64_t cutoffMs) const;
+	T firstValueOlderThan(int64_t cutoffMs) const;
 
 private:
+	size_t slotOf(uint32_t sequence) const;
+	size_t slotAt(size_t position) const { return slotOf(oldestSequence() + position); }
+	size_t positionSince(int64_t cutoffMs) const;
+	int64_t timestampAt(size_t slot) const { return timestampBaseUs + bufferTimestampUs[slot]; }
+	uint32_t oldestSequence() const { return pushedCount - count; }
+	uint32_t firstSequenceSince(int64_t cutoffMs) const;
+	Accumulator sumFrom(uint32_t first) const;
+	uint32_t dequeFirstSince(const uint32_t *deque, size_t front, size_t length, uint32_t sequence) const;
+
 	T buffer[S];
-	int64_t bufferTimestamp[S];
+	// Sample times as 32-bit offsets from timestampBaseUs, rebased as time moves on.
+	// Samples more than ~71 minutes older than the newest share the oldest offset.
+	uint32_t bufferTimestampUs[S];
+	int64_t timestampBaseUs;
+
+	// Running sum of every sample pushed up to and including this slot
+	Accumulator runningSum[S];
+	// Running sum of everything already evicted from the ring
+	Accumulator evictedSum;
+
+	// Monotonic deques of sample sequence numbers: values decrease front to
+	// back in maxDeque and increase front to back in minDeque
+	uint32_t maxDeque[S];
+	uint32_t minDeque[S];
+	size_t maxFront, maxLength;
+	size_t minFront, minLength;
 
+	uint32_t pushedCount;
 	size_t headIndex;
   size_t count;
 };
@@ -2,12 +2,46 @@
 
 template<typename T, size_t S>
 constexpr MathBuffer<T,S>::MathBuffer() :
-		headIndex(0), count(0) {
+		timestampBaseUs(0), evictedSum(0), maxFront(0), maxLength(0), minFront(0), minLength(0),
+		pushedCount(0), headIndex(0), count(0) {
   static_assert(std::is_arithmetic<T>::value, "T must be numeric");
 }
 
 template<typename T,size_t S>
 bool MathBuffer<T, S>::push(T value) {
+  return push(value, (int64_t)millis() * 1000);
+}
+
+template<typename T,size_t S>
+bool MathBuffer<T, S>::push(T value, int64_t timestampUs) {
+  if (count == 0) {
+    timestampBaseUs = timestampUs;
+  } else if (timestampUs - timestampBaseUs > (int64_t)UINT32_MAX) {
+    // Move the base up so the new offset fits, older samples clamp to zero
+    int64_t shift = timestampUs - timestampBaseUs - (int64_t)UINT32_MAX / 2;
+    for (size_t i = 0; i < S; i++) {
+      bufferTimestampUs[i] = bufferTimestampUs[i] > shift ? bufferTimestampUs[i] - (uint32_t)shift : 0;
+    }
+    timestampBaseUs += shift;
+  }
+
+  uint32_t sequence = pushedCount;
+  Accumulator previousSum = count > 0 ? runningSum[headIndex] : evictedSum;
+
+  if (count == S) {
+    // The oldest sample is about to be overwritten, drop it from the window state
+    uint32_t evicted = oldestSequence();
+    evictedSum = runningSum[slotOf(evicted)];
+    if (maxLength > 0 && maxDeque[maxFront] == evicted) {
+      maxFront = (maxFront + 1) % S;
+      maxLength -= 1;
+    }
+    if (minLength > 0 && minDeque[minFront] == evicted) {
+      minFront = (minFront + 1) % S;
+      minLength -= 1;
+    }
+  }
+
   headIndex += 1;
   if (headIndex >= S) {
     headIndex = 0;
@@ -15,97 +49,153 @@ bool MathBuffer<T, S>::push(T value) {
   if (count < S) {
     count += 1;
   }
+  pushedCount += 1;
 
   buffer[headIndex] = value;
-  bufferTimestamp[headIndex] = millis();
+  bufferTimestampUs[headIndex] = (uint32_t)(timestampUs - timestampBaseUs);
+  runningSum[headIndex] = previousSum + value;
+
+  // Anything not larger (smaller) than the new value can never be a window max (min) again
+  while (maxLength > 0 && buffer[slotOf(maxDeque[(maxFront + maxLength - 1) % S])] <= value) {
+    maxLength -= 1;
+  }
+  maxDeque[(maxFront + maxLength) % S] = sequence;
+  maxLength += 1;
+
+  while (minLength > 0 && buffer[slotOf(minDeque[(minFront + minLength - 1) % S])] >= value) {
+    minLength -= 1;
+  }
+  minDeque[(minFront + minLength) % S] = sequence;
+  minLength += 1;
 
   return count == S; // Return true if buffer is full
 }
 
 template<typename T,size_t S>
-void MathBuffer<T, S>::executeOnSamplesSince(int64_t cutoffMs, std::function<void (T, int64_t)> iterator) {
-  for (int i = 0; i < count; i++) {
-    int index = (headIndex - i); // going backward to go from newest to oldest
-    if (index < 0) { // wrap around
-      index += S;
-    }
-    if (bufferTimestamp[index] < cutoffMs) {
-      return;
+size_t MathBuffer<T, S>::slotOf(uint32_t sequence) const {
+  size_t back = (pushedCount - 1) - sequence; // 0 for the newest sample
+  return (headIndex + S - back) % S;
+}
+
+template<typename T,size_t S>
+size_t MathBuffer<T, S>::positionSince(int64_t cutoffMs) const {
+  int64_t cutoffOffsetUs = cutoffMs * 1000 - timestampBaseUs;
+  if (cutoffOffsetUs <= 0) {
+    return 0;
+  }
+  if (cutoffOffsetUs > (int64_t)UINT32_MAX) {
+    return count;
+  }
+
+  // Timestamps only ever increase, so binary search for the oldest sample inside the window
+  size_t low = 0;
+  size_t high = count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (bufferTimestampUs[slotAt(middle)] < (uint32_t)cutoffOffsetUs) {
+      low = middle + 1;
+    } else {
+      high = middle;
     }
-    iterator(buffer[index], bufferTimestamp[index]);
   }
+  return low;
 }
 
 template<typename T,size_t S>
-size_t MathBuffer<T, S>::countSamplesSince(int64_t cutoffMs) {
-  for (int i = 0; i < count; i++) {
-    int index = (headIndex - i); // going backward to go from newest to oldest
-    if (index < 0) { // wrap around
-      index += S;
-    }
-    if (bufferTimestamp[index] < cutoffMs) {
-      return i;
+uint32_t MathBuffer<T, S>::firstSequenceSince(int64_t cutoffMs) const {
+  return oldestSequence() + positionSince(cutoffMs);
+}
+
+template<typename T,size_t S>
+uint32_t MathBuffer<T, S>::dequeFirstSince(const uint32_t *deque, size_t front, size_t length, uint32_t sequence) const {
+  // Deque entries are in push order, so the window's extreme is the oldest entry inside it
+  uint32_t oldest = oldestSequence();
+  size_t low = 0;
+  size_t high = length;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (deque[(front + middle) % S] - oldest < sequence - oldest) {
+      low = middle + 1;
+    } else {
+      high = middle;
     }
   }
+  return deque[(front + low) % S];
+}
 
-  return count;
+template<typename T,size_t S>
+typename MathBuffer<T, S>::Window MathBuffer<T, S>::since(int64_t cutoffMs) const {
+  return Window{const_iterator(this, positionSince(cutoffMs)), end()};
 }
 
+template<typename T,size_t S>
+void MathBuffer<T, S>::executeOnSamplesSince(int64_t cutoffMs, std::function<void (T, int64_t)> iterator) const {
+  Window window = since(cutoffMs);
+  for (const_iterator it = window.end(); it != window.begin();) { // going backward to go from newest to oldest
+    --it;
+    iterator(*it, it.timestamp());
+  }
+}
 
 template<typename T,size_t S>
-T MathBuffer<T, S>::averageSince(int64_t cutoffMs) {
-  size_t sampleCount = countSamplesSince(cutoffMs);
+size_t MathBuffer<T, S>::countSamplesSince(int64_t cutoffMs) const {
+  return pushedCount - firstSequenceSince(cutoffMs);
+}
+
 
-  T average = 0;
-  executeOnSamplesSince(cutoffMs, [&average, &sampleCount](T value, int64_t ms) {
-    average += value / sampleCount;
-  });
+template<typename T,size_t S>
+typename MathBuffer<T, S>::Accumulator MathBuffer<T, S>::sumFrom(uint32_t first) const {
+  if (first == pushedCount) {
+    return 0;
+  }
 
-  return average;
+  Accumulator before = first == oldestSequence() ? evictedSum : runningSum[slotOf(first - 1)];
+  return runningSum[headIndex] - before;
 }
 
 template<typename T,size_t S>
-T MathBuffer<T, S>::maxSince(int64_t cutoffMs) {
-  T max = 0;
-  bool isFirst = true;
-
-  executeOnSamplesSince(cutoffMs, [&max, &isFirst](T value, int64_t ms) {
-    if (isFirst || value > max) {
-      max = value;
-      isFirst = false;
-    }
-  });
+typename MathBuffer<T, S>::Accumulator MathBuffer<T, S>::sumSince(int64_t cutoffMs) const {
+  return sumFrom(firstSequenceSince(cutoffMs));
+}
 
-  return max;
+template<typename T,size_t S>
+T MathBuffer<T, S>::averageSince(int64_t cutoffMs) const {
+  uint32_t first = firstSequenceSince(cutoffMs);
+  size_t sampleCount = pushedCount - first;
+  if (sampleCount == 0) {
+    return 0;
+  }
+
+  return sumFrom(first) / (Accumulator)sampleCount;
 }
 
 template<typename T,size_t S>
-T MathBuffer<T, S>::minSince(int64_t cutoffMs) {
-  T min = 0;
-  bool isFirst = true;
-
-  executeOnSamplesSince(cutoffMs, [&min, &isFirst](T value, int64_t ms) {
-    if (isFirst || value < min) {
-      min = value;
-      isFirst = false;
-    }
-  });
+T MathBuffer<T, S>::maxSince(int64_t cutoffMs) const {
+  uint32_t first = firstSequenceSince(cutoffMs);
+  if (first == pushedCount) {
+    return 0;
+  }
 
-  return min;
+  return buffer[slotOf(dequeFirstSince(maxDeque, maxFront, maxLength, first))];
 }
 
 template<typename T,size_t S>
-T MathBuffer<T, S>::firstValueOlderThan(int64_t cutoffMs) {
-  for (int i = 0; i < count; i++) {
-    int index = (headIndex - i); // going backward to go from newest to oldest
-    if (index < 0) { // wrap around
-      index += S;
-    }
-    if (bufferTimestamp[index] < cutoffMs) {
-      return buffer[index];
-    }
+T MathBuffer<T, S>::minSince(int64_t cutoffMs) const {
+  uint32_t first = firstSequenceSince(cutoffMs);
+  if (first == pushedCount) {
+    return 0;
+  }
+
+  return buffer[slotOf(dequeFirstSince(minDeque, minFront, minLength, first))];
+}
+
+template<typename T,size_t S>
+T MathBuffer<T, S>::firstValueOlderThan(int64_t cutoffMs) const {
+  uint32_t first = firstSequenceSince(cutoffMs);
+  if (first == oldestSequence()) {
+    return 0;
   }
-  return 0;
+  return buffer[slotOf(first - 1)];
 }
 
 // Macro to calculate the absolute value
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <Arduino.h>
+#include "MathBuffer.h"
+
+// Decimated history: every sample is folded into a bucket that is closed
+// once it spans WidthMs. Closed buckets keep their min, max, sum and sample
+// count, so aggregates over many buckets stay exact for min/max and
+// sample-weighted for the mean.
+template<typename T, size_t N, uint32_t WidthMs> class HistoryTier {
+public:
+	using Accumulator = typename MathBuffer<T, N>::Accumulator;
+
+	HistoryTier();
+
+	void add(T value, int64_t timestampUs);
+	bool covers(int64_t cutoffMs) const;
+
+	size_t countSamplesSince(int64_t cutoffMs) const;
+	T averageSince(int64_t cutoffMs) const;
+	T maxSince(int64_t cutoffMs) const;
+	T minSince(int64_t cutoffMs) const;
+	T firstValueOlderThan(int64_t cutoffMs) const;
+
+	// Closed buckets, timestamped with their last sample. Mean of a bucket is sum / count.
+	MathBuffer<T, N> min;
+	MathBuffer<T, N> max;
+	MathBuffer<Accumulator, N> sum;
+	MathBuffer<uint32_t, N> count;
+
+private:
+	int64_t bucketStartedAtUs;
+	int64_t bucketLastAtUs;
+	T bucketMin, bucketMax;
+	Accumulator bucketSum;
+	uint32_t bucketCount;
+};
+
+// Weight history at three resolutions in a fixed memory budget: the last
+// RawSize samples at full rate, then 1 s and 1 min buckets. Queries are
+// answered from the finest tier that still reaches back to the cutoff, so
+// long windows are no longer silently cut short by the raw ring.
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets> class TieredHistory {
+public:
+	using value_type = T;
+	static constexpr size_t capacity = RawSize;
+
+	bool push(T value);
+	bool push(T value, int64_t timestampUs);
+
+	size_t countSamplesSince(int64_t cutoffMs) const;
+	T averageSince(int64_t cutoffMs) const;
+	T maxSince(int64_t cutoffMs) const;
+	T minSince(int64_t cutoffMs) const;
+	T firstValueOlderThan(int64_t cutoffMs) const;
+
+	const MathBuffer<T, RawSize> &raw() const { return rawSamples; }
+	const HistoryTier<T, SecondBuckets, 1000> &seconds() const { return secondTier; }
+	const HistoryTier<T, MinuteBuckets, 60000> &minutes() const { return minuteTier; }
+
+private:
+	bool rawCovers(int64_t cutoffMs) const;
+
+	MathBuffer<T, RawSize> rawSamples;
+	HistoryTier<T, SecondBuckets, 1000> secondTier;
+	HistoryTier<T, MinuteBuckets, 60000> minuteTier;
+};
+
+#include "TieredHistory.tpp"
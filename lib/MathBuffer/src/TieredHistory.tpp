@@ -0,0 +1,156 @@
+#include "TieredHistory.h"
+
+template<typename T, size_t N, uint32_t WidthMs>
+HistoryTier<T, N, WidthMs>::HistoryTier() :
+		bucketStartedAtUs(0), bucketLastAtUs(0), bucketMin(0), bucketMax(0), bucketSum(0), bucketCount(0) {
+}
+
+template<typename T, size_t N, uint32_t WidthMs>
+void HistoryTier<T, N, WidthMs>::add(T value, int64_t timestampUs) {
+  if (bucketCount > 0 && timestampUs - bucketStartedAtUs >= (int64_t)WidthMs * 1000) {
+    // Stamped with the bucket's own last sample, so a cutoff after it leaves the bucket out
+    min.push(bucketMin, bucketLastAtUs);
+    max.push(bucketMax, bucketLastAtUs);
+    sum.push(bucketSum, bucketLastAtUs);
+    count.push(bucketCount, bucketLastAtUs);
+    bucketCount = 0;
+  }
+
+  if (bucketCount == 0) {
+    bucketStartedAtUs = timestampUs;
+    bucketMin = value;
+    bucketMax = value;
+    bucketSum = 0;
+  }
+  if (value < bucketMin) {
+    bucketMin = value;
+  }
+  if (value > bucketMax) {
+    bucketMax = value;
+  }
+  bucketSum += value;
+  bucketCount += 1;
+  bucketLastAtUs = timestampUs;
+}
+
+template<typename T, size_t N, uint32_t WidthMs>
+bool HistoryTier<T, N, WidthMs>::covers(int64_t cutoffMs) const {
+  // Either nothing was evicted yet, or the oldest bucket ended before the cutoff
+  return count.size() < N || count.begin().timestamp() < cutoffMs;
+}
+
+template<typename T, size_t N, uint32_t WidthMs>
+size_t HistoryTier<T, N, WidthMs>::countSamplesSince(int64_t cutoffMs) const {
+  return count.sumSince(cutoffMs) + bucketCount;
+}
+
+template<typename T, size_t N, uint32_t WidthMs>
+T HistoryTier<T, N, WidthMs>::averageSince(int64_t cutoffMs) const {
+  size_t samples = countSamplesSince(cutoffMs);
+  if (samples == 0) {
+    return 0;
+  }
+  return (sum.sumSince(cutoffMs) + bucketSum) / (Accumulator)samples;
+}
+
+template<typename T, size_t N, uint32_t WidthMs>
+T HistoryTier<T, N, WidthMs>::maxSince(int64_t cutoffMs) const {
+  if (max.countSamplesSince(cutoffMs) == 0) {
+    return bucketCount > 0 ? bucketMax : 0;
+  }
+  T closedMax = max.maxSince(cutoffMs);
+  return bucketCount > 0 && bucketMax > closedMax ? bucketMax : closedMax;
+}
+
+template<typename T, size_t N, uint32_t WidthMs>
+T HistoryTier<T, N, WidthMs>::minSince(int64_t cutoffMs) const {
+  if (min.countSamplesSince(cutoffMs) == 0) {
+    return bucketCount > 0 ? bucketMin : 0;
+  }
+  T closedMin = min.minSince(cutoffMs);
+  return bucketCount > 0 && bucketMin < closedMin ? bucketMin : closedMin;
+}
+
+template<typename T, size_t N, uint32_t WidthMs>
+T HistoryTier<T, N, WidthMs>::firstValueOlderThan(int64_t cutoffMs) const {
+  uint32_t samples = count.firstValueOlderThan(cutoffMs);
+  if (samples == 0) {
+    return 0;
+  }
+  return sum.firstValueOlderThan(cutoffMs) / (Accumulator)samples;
+}
+
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets>
+bool TieredHistory<T, RawSize, SecondBuckets, MinuteBuckets>::push(T value) {
+  return push(value, (int64_t)millis() * 1000);
+}
+
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets>
+bool TieredHistory<T, RawSize, SecondBuckets, MinuteBuckets>::push(T value, int64_t timestampUs) {
+  secondTier.add(value, timestampUs);
+  minuteTier.add(value, timestampUs);
+  return rawSamples.push(value, timestampUs);
+}
+
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets>
+bool TieredHistory<T, RawSize, SecondBuckets, MinuteBuckets>::rawCovers(int64_t cutoffMs) const {
+  return rawSamples.size() < RawSize || rawSamples.begin().timestamp() < cutoffMs;
+}
+
+// Each query below falls through raw -> seconds -> minutes. The minute tier
+// answers with whatever it still holds once a cutoff is older than all tiers.
+
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets>
+size_t TieredHistory<T, RawSize, SecondBuckets, MinuteBuckets>::countSamplesSince(int64_t cutoffMs) const {
+  if (rawCovers(cutoffMs)) {
+    return rawSamples.countSamplesSince(cutoffMs);
+  }
+  if (secondTier.covers(cutoffMs)) {
+    return secondTier.countSamplesSince(cutoffMs);
+  }
+  return minuteTier.countSamplesSince(cutoffMs);
+}
+
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets>
+T TieredHistory<T, RawSize, SecondBuckets, MinuteBuckets>::averageSince(int64_t cutoffMs) const {
+  if (rawCovers(cutoffMs)) {
+    return rawSamples.averageSince(cutoffMs);
+  }
+  if (secondTier.covers(cutoffMs)) {
+    return secondTier.averageSince(cutoffMs);
+  }
+  return minuteTier.averageSince(cutoffMs);
+}
+
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets>
+T TieredHistory<T, RawSize, SecondBuckets, MinuteBuckets>::maxSince(int64_t cutoffMs) const {
+  if (rawCovers(cutoffMs)) {
+    return rawSamples.maxSince(cutoffMs);
+  }
+  if (secondTier.covers(cutoffMs)) {
+    return secondTier.maxSince(cutoffMs);
+  }
+  return minuteTier.maxSince(cutoffMs);
+}
+
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets>
+T TieredHistory<T, RawSize, SecondBuckets, MinuteBuckets>::minSince(int64_t cutoffMs) const {
+  if (rawCovers(cutoffMs)) {
+    return rawSamples.minSince(cutoffMs);
+  }
+  if (secondTier.covers(cutoffMs)) {
+    return secondTier.minSince(cutoffMs);
+  }
+  return minuteTier.minSince(cutoffMs);
+}
+
+template<typename T, size_t RawSize, size_t SecondBuckets, size_t MinuteBuckets>
+T TieredHistory<T, RawSize, SecondBuckets, MinuteBuckets>::firstValueOlderThan(int64_t cutoffMs) const {
+  if (rawCovers(cutoffMs)) {
+    return rawSamples.firstValueOlderThan(cutoffMs);
+  }
+  if (secondTier.covers(cutoffMs)) {
+    return secondTier.firstValueOlderThan(cutoffMs);
+  }
+  return minuteTier.firstValueOlderThan(cutoffMs);
+}
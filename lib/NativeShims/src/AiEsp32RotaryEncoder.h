@@ -0,0 +1,24 @@
+#pragma once
+#include <Arduino.h>
+
+// Rotary encoder that never turns unless a test sets it
+class AiEsp32RotaryEncoder {
+public:
+	AiEsp32RotaryEncoder(uint8_t aPin, uint8_t bPin, int buttonPin = -1, int vccPin = -1, uint8_t steps = 2) {}
+
+	void begin() {}
+	void setup(void (*isr)(void)) {}
+	void setBoundaries(long minValue, long maxValue, bool circleValues) {}
+	void setAcceleration(unsigned long value) {}
+	void readEncoder_ISR() {}
+	long readEncoder() { return value; }
+	long encoderChanged() { long delta = value - lastValue; lastValue = value; return delta; }
+	bool isEncoderButtonClicked() { bool result = clicked; clicked = false; return result; }
+
+	// Test hooks
+	long value = 0;
+	bool clicked = false;
+
+private:
+	long lastValue = 0;
+};
@@ -0,0 +1,94 @@
+#pragma once
+// Minimal Arduino core for host builds. Time only moves when a test
+// advances it (or firmware code calls delay()), which keeps runs repeatable.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+namespace native {
+	// Simulated clock in microseconds since boot
+	extern int64_t nowUs;
+	// Moves the clock forward to untilUs, firing the esp_timers that fall due on the way
+	void advanceTo(int64_t untilUs);
+	void advanceMillis(uint32_t ms);
+	void advanceMicros(uint32_t us);
+
+	// Pin levels written by the firmware or forced by a test
+	static constexpr int PIN_COUNT = 40;
+	extern int pinLevels[PIN_COUNT];
+
+	// Echo Serial output to stdout, off by default to keep test output readable
+	extern bool serialEcho;
+	// When set, Serial output is also appended here so a test can parse it
+	extern std::string *serialCapture;
+
+	// What temperatureRead() reports, degrees C
+	extern float chipTemperature;
+}
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+float temperatureRead();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+// Interrupts never fire on the host, tests call the step functions directly
+#define digitalPinToInterrupt(pin) (pin)
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t pin);
+
+class HardwareSerial {
+public:
+	void begin(unsigned long baud) {}
+
+	size_t print(const char *value);
+	size_t print(char value);
+	size_t print(int value);
+	size_t print(unsigned int value);
+	size_t print(long value);
+	size_t print(unsigned long value);
+	size_t print(double value, int digits = 2);
+	size_t println();
+	template<typename V> size_t println(V value) { return print(value) + println(); }
+	size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+	uint32_t getCycleCount(); // host nanoseconds, truncated
+	void restart() {}
+};
+extern EspClass ESP;
+
+// Nothing shuts down on the host, the handler is never called
+typedef void (*shutdown_handler_t)(void);
+inline int esp_register_shutdown_handler(shutdown_handler_t handler) { return 0; }
@@ -0,0 +1,30 @@
+// Stand-ins for the firmware modules that only build on the device
+// (main.cpp, rotary.cpp, display.cpp, shotlog.cpp). Weak, so a test can provide its own.
+#include "config.hpp"
+#include "rotary.hpp"
+#include "display.hpp"
+#include "shotlog.hpp"
+
+#define WEAK __attribute__((weak))
+
+WEAK Preferences preferences;
+WEAK HX711 loadcell;
+WEAK FixedKalmanFilter kalmanFilter(FILTER_MEASUREMENT_ERROR, FILTER_MEASUREMENT_ERROR, FIXED_Q16(0.1));
+WEAK TaskHandle_t ScaleTask = nullptr;
+WEAK TaskHandle_t ScaleStatusTask = nullptr;
+WEAK TaskHandle_t RotaryTask = nullptr;
+WEAK TaskHandle_t SettingsTask = nullptr;
+WEAK TaskHandle_t ShotLogTask = nullptr;
+WEAK volatile bool displayLock = false;
+
+WEAK AiEsp32RotaryEncoder rotaryEncoder(ROTARY_ENCODER_A_PIN, ROTARY_ENCODER_B_PIN, ROTARY_ENCODER_BUTTON_PIN,
+                                        ROTARY_ENCODER_VCC_PIN, ROTARY_ENCODER_STEPS);
+WEAK bool debugMode = false;
+WEAK int sleepTime = SLEEP_AFTER_MS;
+WEAK bool screenJustWoke = false;
+
+WEAK void rotary_loop() {}
+WEAK void updateRotary(void *parameter) {}
+WEAK void readEncoderISR() {}
+WEAK void wakeScreen() {}
+WEAK bool logShot(const ShotRecord &shot) { return true; }
@@ -0,0 +1,38 @@
+#pragma once
+#include <Arduino.h>
+#include <deque>
+
+// HX711 stand-in fed by tests. Readings queued with feed() are returned in
+// order, after that read() keeps returning the last raw value.
+class HX711 {
+public:
+	void begin(byte dout, byte pd_sck, byte gain = 128) {}
+	bool is_ready() { return ready; }
+	void wait_ready(unsigned long delay_ms = 0) {}
+	bool wait_ready_retry(int retries = 3, unsigned long delay_ms = 0) { return ready; }
+	bool wait_ready_timeout(unsigned long timeout = 1000, unsigned long delay_ms = 0) { return ready; }
+
+	long read();
+	long read_average(byte times = 10);
+	double get_value(byte times = 1) { return read_average(times) - offset; }
+	float get_units(byte times = 1) { return get_value(times) / scale; }
+	void tare(byte times = 10) { offset = read_average(times); }
+
+	void set_scale(float value = 1.f) { scale = value; }
+	float get_scale() { return scale; }
+	void set_offset(long value = 0) { offset = value; }
+	long get_offset() { return offset; }
+	void power_down() {}
+	void power_up() {}
+
+	// Test hooks
+	void feed(long raw) { pending.push_back(raw); }
+	void setRaw(long raw) { pending.clear(); lastRaw = raw; }
+	bool ready = true;
+
+private:
+	std::deque<long> pending;
+	long lastRaw = 0;
+	long offset = 0;
+	float scale = 1.f;
+};
@@ -0,0 +1,299 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <HX711.h>
+#include <Preferences.h>
+#include <U8g2lib.h>
+#include <chrono>
+#include <stdarg.h>
+#include <vector>
+
+namespace native {
+	int64_t nowUs = 0;
+	int pinLevels[PIN_COUNT] = {};
+	bool serialEcho = false;
+	std::string *serialCapture = nullptr;
+	float chipTemperature = 25;
+}
+
+struct esp_timer {
+	esp_timer_cb_t callback;
+	void *arg;
+	bool armed;
+	int64_t deadlineUs;
+};
+
+static std::vector<esp_timer *> timers;
+
+namespace native {
+	// Due timers fire in deadline order, each at its own deadline
+	void advanceTo(int64_t untilUs) {
+		for (;;) {
+			esp_timer *next = nullptr;
+			for (esp_timer *timer : timers) {
+				if (timer->armed && timer->deadlineUs <= untilUs && (next == nullptr || timer->deadlineUs < next->deadlineUs)) {
+					next = timer;
+				}
+			}
+			if (next == nullptr) {
+				break;
+			}
+			nowUs = std::max(nowUs, next->deadlineUs);
+			next->armed = false;
+			next->callback(next->arg);
+		}
+		nowUs = std::max(nowUs, untilUs);
+	}
+
+	void advanceMillis(uint32_t ms) { advanceTo(nowUs + (int64_t)ms * 1000); }
+	void advanceMicros(uint32_t us) { advanceTo(nowUs + us); }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle) {
+	if (args == nullptr || args->callback == nullptr || handle == nullptr) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	*handle = new esp_timer{args->callback, args->arg, false, 0};
+	timers.push_back(*handle);
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeoutUs) {
+	if (timer == nullptr) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer->armed = true;
+	timer->deadlineUs = native::nowUs + (int64_t)timeoutUs;
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+	if (timer == nullptr) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (!timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer->armed = false;
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+	if (timer == nullptr) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timers.erase(std::find(timers.begin(), timers.end(), timer));
+	delete timer;
+	return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+	return timer != nullptr && timer->armed;
+}
+
+unsigned long millis() { return (unsigned long)(native::nowUs / 1000); }
+unsigned long micros() { return (unsigned long)native::nowUs; }
+void delay(unsigned long ms) { native::advanceMillis(ms); }
+void delayMicroseconds(unsigned int us) { native::advanceMicros(us); }
+void yield() {}
+float temperatureRead() { return native::chipTemperature; }
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (mode == INPUT_PULLUP && pin < native::PIN_COUNT) {
+    native::pinLevels[pin] = HIGH;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < native::PIN_COUNT) {
+    native::pinLevels[pin] = value;
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < native::PIN_COUNT ? native::pinLevels[pin] : LOW;
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode) {}
+void detachInterrupt(uint8_t pin) {}
+
+HardwareSerial Serial;
+
+static size_t vecho(const char *format, va_list args) {
+  if (!native::serialEcho && native::serialCapture == nullptr) {
+    return 0;
+  }
+  char text[256];
+  int written = vsnprintf(text, sizeof(text), format, args);
+  if (written <= 0) {
+    return 0;
+  }
+  written = std::min(written, (int)sizeof(text) - 1);
+  if (native::serialEcho) {
+    fwrite(text, 1, written, stdout);
+  }
+  if (native::serialCapture != nullptr) {
+    native::serialCapture->append(text, written);
+  }
+  return written;
+}
+
+static size_t echo(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t written = vecho(format, args);
+  va_end(args);
+  return written;
+}
+
+size_t HardwareSerial::print(const char *value) { return echo("%s", value); }
+size_t HardwareSerial::print(char value) { return echo("%c", value); }
+size_t HardwareSerial::print(int value) { return echo("%d", value); }
+size_t HardwareSerial::print(unsigned int value) { return echo("%u", value); }
+size_t HardwareSerial::print(long value) { return echo("%ld", value); }
+size_t HardwareSerial::print(unsigned long value) { return echo("%lu", value); }
+size_t HardwareSerial::print(double value, int digits) { return echo("%.*f", digits, value); }
+size_t HardwareSerial::println() { return echo("\n"); }
+
+size_t HardwareSerial::printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t written = vecho(format, args);
+  va_end(args);
+  return written;
+}
+
+EspClass ESP;
+
+uint32_t EspClass::getCycleCount() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackDepth, void *parameter,
+                                   UBaseType_t priority, TaskHandle_t *createdTask, BaseType_t coreId) {
+  // Firmware tasks loop forever, host tests drive their step functions directly
+  if (createdTask) {
+    *createdTask = nullptr;
+  }
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {}
+void vTaskDelay(TickType_t ticks) { native::advanceMillis(ticks * portTICK_PERIOD_MS); }
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higherPriorityTaskWoken) {}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  return pdPASS;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait) {
+  vTaskDelay(ticksToWait);
+  return 0;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clearOnEntry, uint32_t clearOnExit, uint32_t *value, TickType_t ticksToWait) {
+  vTaskDelay(ticksToWait);
+  if (value) {
+    *value = 0;
+  }
+  return pdFALSE;
+}
+
+long HX711::read() {
+  if (!pending.empty()) {
+    lastRaw = pending.front();
+    pending.pop_front();
+  }
+  return lastRaw;
+}
+
+long HX711::read_average(byte times) {
+  long sum = 0;
+  for (byte i = 0; i < times; i++) {
+    sum += read();
+  }
+  return times > 0 ? sum / times : 0;
+}
+
+static std::map<std::string, std::vector<uint8_t>> &nvs() {
+  static std::map<std::string, std::vector<uint8_t>> storage;
+  return storage;
+}
+
+uint32_t Preferences::writeCount = 0;
+
+bool Preferences::begin(const char *name, bool readOnly, const char *partitionLabel) {
+  space = name;
+  opened = true;
+  this->readOnly = readOnly;
+  return true;
+}
+
+void Preferences::end() {
+  opened = false;
+}
+
+bool Preferences::clear() {
+  if (!opened || readOnly) {
+    return false;
+  }
+  std::string prefix = space + "/";
+  for (auto it = nvs().begin(); it != nvs().end();) {
+    it = it->first.compare(0, prefix.size(), prefix) == 0 ? nvs().erase(it) : std::next(it);
+  }
+  return true;
+}
+
+bool Preferences::remove(const char *key) {
+  return opened && !readOnly && nvs().erase(fullKey(key)) > 0;
+}
+
+bool Preferences::isKey(const char *key) {
+  return opened && nvs().count(fullKey(key)) > 0;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t length) {
+  if (!opened || readOnly) {
+    return 0;
+  }
+  const uint8_t *bytes = static_cast<const uint8_t *>(value);
+  nvs()[fullKey(key)] = std::vector<uint8_t>(bytes, bytes + length);
+  writeCount += 1;
+  return length;
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+  auto it = nvs().find(fullKey(key));
+  return opened && it != nvs().end() ? it->second.size() : 0;
+}
+
+size_t Preferences::getBytes(const char *key, void *buffer, size_t maxLength) {
+  auto it = nvs().find(fullKey(key));
+  if (!opened || it == nvs().end() || it->second.size() > maxLength) {
+    return 0;
+  }
+  memcpy(buffer, it->second.data(), it->second.size());
+  return it->second.size();
+}
+
+void Preferences::clearAll() {
+  nvs().clear();
+  writeCount = 0;
+}
+
+const uint8_t u8g2_font_5x8_tf[] = {0};
+const uint8_t u8g2_font_7x13_tf[] = {0};
+const uint8_t u8g2_font_7x13_tr[] = {0};
+const uint8_t u8g2_font_7x14B_tf[] = {0};
+const uint8_t u8g2_font_unifont_t_symbols[] = {0};
@@ -0,0 +1,43 @@
+#pragma once
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// In-memory NVS. Values survive end()/begin() and live until clearAll().
+class Preferences {
+public:
+	bool begin(const char *name, bool readOnly = false, const char *partitionLabel = nullptr);
+	void end();
+	bool clear();
+	bool remove(const char *key);
+	bool isKey(const char *key);
+
+	size_t putBool(const char *key, bool value) { return putBytes(key, &value, sizeof(value)); }
+	size_t putInt(const char *key, int32_t value) { return putBytes(key, &value, sizeof(value)); }
+	size_t putUInt(const char *key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+	size_t putDouble(const char *key, double value) { return putBytes(key, &value, sizeof(value)); }
+	size_t putBytes(const char *key, const void *value, size_t length);
+
+	bool getBool(const char *key, bool defaultValue = false) { return get(key, defaultValue); }
+	int32_t getInt(const char *key, int32_t defaultValue = 0) { return get(key, defaultValue); }
+	uint32_t getUInt(const char *key, uint32_t defaultValue = 0) { return get(key, defaultValue); }
+	double getDouble(const char *key, double defaultValue = NAN) { return get(key, defaultValue); }
+	size_t getBytesLength(const char *key);
+	size_t getBytes(const char *key, void *buffer, size_t maxLength);
+
+	// Test hooks
+	static void clearAll();
+	static uint32_t writeCount;
+
+private:
+	template<typename V> V get(const char *key, V defaultValue) {
+		V value;
+		return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+	}
+	std::string fullKey(const char *key) const { return space + "/" + key; }
+
+	std::string space;
+	bool opened = false;
+	bool readOnly = false;
+};
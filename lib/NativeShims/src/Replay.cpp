@@ -0,0 +1,189 @@
+#include "Replay.h"
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <fstream>
+#include <sstream>
+#include "config.hpp"
+#include "scale.hpp"
+#include "relay.hpp"
+
+namespace native {
+	static void parseSettings(const std::string &line, Recording &recording) {
+		std::istringstream tokens(line.substr(1));
+		std::string token;
+		while (tokens >> token) {
+			size_t equals = token.find('=');
+			if (equals == std::string::npos) {
+				continue;
+			}
+			std::string key = token.substr(0, equals);
+			if (key == "offsetTable") {
+				for (size_t i = equals + 1; i + 1 < token.size(); i += 2) {
+					recording.offsetTable.push_back((uint8_t)strtol(token.substr(i, 2).c_str(), nullptr, 16));
+				}
+				continue;
+			}
+			const char *text = token.c_str() + equals + 1;
+			if (key == "drift") recording.driftCountsPerDegree = strtof(text, nullptr);
+			else if (key == "reference") recording.referenceCelsius = strtof(text, nullptr);
+			else if (key == "celsius") recording.celsius = strtof(text, nullptr);
+			long value = strtol(text, nullptr, 10);
+			if (key == "mgPerCountQ16") recording.mgPerCountQ16 = value;
+			else if (key == "offset") recording.offset = value;
+			else if (key == "setWeight") recording.setWeight = value;
+			else if (key == "setCupWeight") recording.setCupWeight = value;
+			else if (key == "grindMode") recording.grindMode = value != 0;
+			else if (key == "scaleMode") recording.scaleMode = value != 0;
+			else if (key == "grindTrigger") recording.grindTrigger = value != 0;
+			else if (key == "stopDelay") recording.stopDelayMs = value;
+			else if (key == "topUp") recording.topUp = value != 0;
+			else if (key == "pulseRate") recording.pulseRateMgPerS = value;
+			else if (key == "zero") recording.zeroCounts = value;
+		}
+	}
+
+	bool parseRecording(const std::string &text, Recording &recording) {
+		std::istringstream lines(text);
+		std::string line;
+		bool inside = false;
+		bool ended = false;
+		recording = Recording();
+		while (std::getline(lines, line)) {
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (line.rfind("# openGBW recording v", 0) == 0) {
+				inside = true;
+				recording.raw = line.rfind("# openGBW recording v1", 0) != 0;
+				continue;
+			}
+			if (!inside) {
+				continue;
+			}
+			if (line == "# end") {
+				ended = true;
+				break;
+			}
+			if (line.rfind("#", 0) == 0) {
+				parseSettings(line, recording);
+				continue;
+			}
+			unsigned long offsetUs;
+			long counts;
+			float celsius;
+			if (sscanf(line.c_str(), "T %lu %f", &offsetUs, &celsius) == 2) {
+				recording.events.push_back({(uint32_t)offsetUs, false, celsius});
+			} else if (sscanf(line.c_str(), "tare %lu", &offsetUs) == 1) {
+				recording.events.push_back({(uint32_t)offsetUs, true, NAN});
+			} else if (sscanf(line.c_str(), "%lu %ld", &offsetUs, &counts) == 2) {
+				recording.readings.push_back({(uint32_t)offsetUs, (int32_t)counts});
+			}
+		}
+		return ended && recording.mgPerCountQ16 != 0;
+	}
+
+	bool loadRecording(const char *path, Recording &recording) {
+		std::ifstream file(path);
+		if (!file) {
+			return false;
+		}
+		std::stringstream text;
+		text << file.rdbuf();
+		return parseRecording(text.str(), recording);
+	}
+
+	ReplayResult replay(const Recording &recording) {
+		ReplayResult result = {};
+		result.stoppedAtUs = -1;
+		mgPerCountQ16 = recording.mgPerCountQ16;
+		offset = recording.offset;
+		setWeight = recording.setWeight;
+		setCupWeight = recording.setCupWeight;
+		grindMode = recording.grindMode;
+		scaleMode = recording.scaleMode;
+		useButtonToGrind = recording.grindTrigger;
+		stopDelayMs = recording.stopDelayMs;
+		topUpMode = recording.topUp;
+		pulseRateMgPerS = recording.pulseRateMgPerS > 0 ? recording.pulseRateMgPerS : TOPUP_PULSE_RATE;
+		offsetTable.clear();
+		if (recording.offsetTable.size() == StopOffsetTable::bytes()) {
+			std::copy(recording.offsetTable.begin(), recording.offsetTable.end(), (uint8_t *)offsetTable.data());
+		}
+		setupRelay();
+		scaleStatus = STATUS_EMPTY;
+		tarePending = false;
+		if (recording.raw) {
+			restoreZeroState(recording.zeroCounts, recording.driftCountsPerDegree, recording.referenceCelsius, recording.celsius);
+		}
+		unsigned int shotsBefore = shotCount;
+		if (recording.readings.empty()) {
+			result.finalOffset = stopOffsetFor(grindTargetMg(), 0);
+			return result;
+		}
+
+		// Start the filter where the recording starts instead of sliding over from the last test
+		int32_t firstCounts = recording.readings.front().counts - (recording.raw ? recording.zeroCounts : 0);
+		kalmanFilter.setEstimate((int32_t)(((int64_t)firstCounts * mgPerCountQ16 + (1 << 15)) >> 16));
+
+		int64_t startUs = nowUs + 1000;
+		int64_t stoppedBeforeUs = grinderStoppedAtUs();
+		int64_t lastStatusStepUs = startUs;
+		auto runStatusStep = [&](uint8_t events) {
+			lastStatusStepUs = nowUs;
+			for (int i = 0; i < 10; i++) {
+				int before = scaleStatus;
+				bool again = scaleStatusStep(events);
+				if (scaleStatus != before) {
+					result.statusChanges.push_back({(uint32_t)((nowUs - startUs) / 1000), before, scaleStatus, scaleWeight});
+				}
+				if (!again) {
+					break;
+				}
+			}
+		};
+		// Between readings the status task only wakes on its timeout
+		auto runIdleSteps = [&](int64_t untilUs) {
+			while (lastStatusStepUs + STATUS_IDLE_TIMEOUT_MS * 1000 <= untilUs) {
+				advanceTo(lastStatusStepUs + STATUS_IDLE_TIMEOUT_MS * 1000);
+				runStatusStep(EVENT_TIMEOUT);
+			}
+		};
+
+		size_t nextEvent = 0;
+		for (const RecordedReading &reading : recording.readings) {
+			int64_t readingUs = startUs + reading.offsetUs;
+			runIdleSteps(readingUs - 1);
+			// The relay timer fires in between, as it does on the device
+			advanceTo(readingUs);
+			for (; nextEvent < recording.events.size() && recording.events[nextEvent].offsetUs <= reading.offsetUs; nextEvent++) {
+				if (recording.events[nextEvent].tare) {
+					tareScale();
+				} else {
+					processTemperatureReading(recording.events[nextEvent].celsius);
+				}
+			}
+			int32_t counts = reading.counts;
+			if (recording.raw) {
+				counts = zeroScaleReading(counts, esp_timer_get_time());
+			}
+			processScaleReading(counts, esp_timer_get_time());
+			runStatusStep(EVENT_SAMPLE);
+		}
+
+		// Offsets are learned per grind time, look up the one the last shot ground for
+		uint32_t grindMs = 0;
+		for (size_t i = 0; i < result.statusChanges.size(); i++) {
+			if (result.statusChanges[i].to == STATUS_GRINDING_IN_PROGRESS) {
+				grindMs = result.statusChanges[i].atMs;
+			} else if (result.statusChanges[i].from == STATUS_GRINDING_IN_PROGRESS) {
+				grindMs = result.statusChanges[i].atMs - grindMs;
+			}
+		}
+		result.finalOffset = stopOffsetFor(grindTargetMg(), grindMs);
+		result.shots = shotCount - shotsBefore;
+		if (grinderStoppedAtUs() != stoppedBeforeUs) {
+			result.stoppedAtUs = grinderStoppedAtUs() - startUs;
+		}
+		return result;
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+// Replays a raw sample recording, as printed by the debug menu's "Dump Samples",
+// through the firmware's filter and grind state machine with the recorded timing.
+// The recording is open loop: relay decisions made during the replay don't change
+// what the load cell saw on the device.
+#include <math.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace native {
+	struct RecordedReading {
+		uint32_t offsetUs; // since the first reading
+		int32_t counts;    // raw HX711 counts, tared ones in v1 dumps
+	};
+
+	// A temperature reading or a tare, applied before the first reading not older than it
+	struct RecordedEvent {
+		uint32_t offsetUs;
+		bool tare;
+		float celsius;
+	};
+
+	struct Recording {
+		int32_t mgPerCountQ16 = 0;
+		int32_t offset = 0;
+		int32_t setWeight = 0;
+		int32_t setCupWeight = 0;
+		bool grindMode = false;
+		bool scaleMode = false;
+		bool grindTrigger = false;
+		uint32_t stopDelayMs = 0; // older dumps predate the predictive stop
+		bool topUp = false;
+		uint32_t pulseRateMgPerS = 0; // 0 in dumps from before the top-up mode
+		std::vector<uint8_t> offsetTable; // learned stop offsets as their NVS blob, empty in older dumps
+		bool raw = false; // v1 dumps hold counts that were already tared on the device
+		// The zero and drift correction at the first reading
+		int32_t zeroCounts = 0;
+		float driftCountsPerDegree = 0;
+		float referenceCelsius = NAN;
+		float celsius = NAN;
+		std::vector<RecordedReading> readings;
+		std::vector<RecordedEvent> events;
+	};
+
+	// A change of scaleStatus seen during a replay
+	struct StatusChange {
+		uint32_t atMs; // since the first reading
+		int from;
+		int to;
+		int32_t weight; // scaleWeight at that moment, mg
+	};
+
+	struct ReplayResult {
+		std::vector<StatusChange> statusChanges;
+		int32_t finalOffset; // what the next shot of the recorded dose and grind time would stop at
+		unsigned int shots; // shots counted during the replay
+		int64_t stoppedAtUs; // since the first reading, when the relay last dropped; -1 if it never did
+	};
+
+	// Parses a serial dump; anything around the recording block is skipped
+	bool parseRecording(const std::string &text, Recording &recording);
+	bool loadRecording(const char *path, Recording &recording);
+
+	// Applies the recorded settings and zero, then feeds each reading through zeroScaleReading
+	// and processScaleReading at its recorded time, with the temperature readings and tares
+	// in between, and runs scaleStatusStep after it, as scaleStatusLoop does
+	ReplayResult replay(const Recording &recording);
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <Arduino.h>
+
+typedef uint16_t u8g2_uint_t;
+typedef int u8g2_cb_t;
+#define U8G2_R0 0
+
+extern const uint8_t u8g2_font_5x8_tf[];
+extern const uint8_t u8g2_font_7x13_tf[];
+extern const uint8_t u8g2_font_7x13_tr[];
+extern const uint8_t u8g2_font_7x14B_tf[];
+extern const uint8_t u8g2_font_unifont_t_symbols[];
+
+// Display that accepts every drawing call and shows nothing
+class U8G2_SSD1306_128X64_NONAME_F_HW_I2C {
+public:
+	explicit U8G2_SSD1306_128X64_NONAME_F_HW_I2C(u8g2_cb_t rotation) {}
+
+	bool begin() { return true; }
+	void clearBuffer() {}
+	void sendBuffer() {}
+	void setFont(const uint8_t *font) {}
+	void setFontPosTop() {}
+	void setFontPosCenter() {}
+	void setFontPosBottom() {}
+	void setDrawColor(uint8_t color) {}
+	void setCursor(u8g2_uint_t x, u8g2_uint_t y) {}
+	u8g2_uint_t getStrWidth(const char *str) { return strlen(str) * 7; }
+	u8g2_uint_t drawStr(u8g2_uint_t x, u8g2_uint_t y, const char *str) { return getStrWidth(str); }
+	u8g2_uint_t drawGlyph(u8g2_uint_t x, u8g2_uint_t y, uint16_t encoding) { return 7; }
+	void drawBox(u8g2_uint_t x, u8g2_uint_t y, u8g2_uint_t w, u8g2_uint_t h) {}
+	template<typename V> size_t print(V value) { return 0; }
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Learned stop-offset corrections over a grid of target dose and grind duration.
+// Lookups interpolate bilinearly between the four surrounding grid points. A
+// shot tells what the offset should have been at its dose and grind time; each
+// of the four points moves towards that by its interpolation weight, so a point
+// converges on the offset around it and doses far apart don't disturb each
+// other, then whatever is still missing there is shared out so the lookup at
+// that dose and time comes out right. Points no shot has landed near yet copy the nearest learned point, so
+// a new dose or grind time starts from what is known instead of from zero.
+// Outside the grid the edge points are used.
+template<size_t DOSES, size_t DURATIONS> class OffsetTable {
+public:
+	static_assert(DOSES >= 2 && DURATIONS >= 2, "need two points along each axis to interpolate");
+
+	OffsetTable(int32_t firstDoseMg, int32_t doseStepMg, uint32_t firstDurationMs, uint32_t durationStepMs);
+
+	int32_t lookup(int32_t doseMg, uint32_t grindMs) const;
+	void learn(int32_t doseMg, uint32_t grindMs, int32_t correction);
+	void clear();
+	// Shots that landed close to a grid point, saturating at 255
+	uint8_t shotsAt(size_t dose, size_t duration) const { return state.shots[dose][duration]; }
+
+	// Whole table as one blob, for NVS
+	void *data() { return &state; }
+	const void *data() const { return &state; }
+	static constexpr size_t bytes() { return sizeof(State); }
+
+private:
+	// A shot counts towards a grid point once it carries at least this much of its weight
+	static constexpr uint32_t LEARNED_WEIGHT_Q16 = 65536 / 4;
+
+	struct State {
+		int32_t offsets[DOSES][DURATIONS];
+		uint8_t shots[DOSES][DURATIONS];
+	};
+
+	// Grid point at or below a coordinate and how far (Q16) towards the next one it sits
+	static void locate(int64_t coordinate, int64_t first, int64_t step, size_t count, size_t &index, uint32_t &fractionQ16);
+	void corners(int32_t doseMg, uint32_t grindMs, size_t &dose, size_t &duration, uint32_t weightsQ16[4]) const;
+	void fillUnlearned();
+
+	State state;
+	int32_t firstDoseMg;
+	int32_t doseStepMg;
+	uint32_t firstDurationMs;
+	uint32_t durationStepMs;
+};
+
+#include "OffsetTable.tpp"
@@ -0,0 +1,114 @@
+#include "OffsetTable.h"
+
+template<size_t DOSES, size_t DURATIONS>
+OffsetTable<DOSES, DURATIONS>::OffsetTable(int32_t firstDoseMg, int32_t doseStepMg, uint32_t firstDurationMs, uint32_t durationStepMs) :
+		firstDoseMg(firstDoseMg), doseStepMg(doseStepMg), firstDurationMs(firstDurationMs), durationStepMs(durationStepMs) {
+  clear();
+}
+
+template<size_t DOSES, size_t DURATIONS>
+void OffsetTable<DOSES, DURATIONS>::clear() {
+  for (size_t i = 0; i < DOSES; i++) {
+    for (size_t j = 0; j < DURATIONS; j++) {
+      state.offsets[i][j] = 0;
+      state.shots[i][j] = 0;
+    }
+  }
+}
+
+template<size_t DOSES, size_t DURATIONS>
+void OffsetTable<DOSES, DURATIONS>::locate(int64_t coordinate, int64_t first, int64_t step, size_t count, size_t &index, uint32_t &fractionQ16) {
+  int64_t position = coordinate - first;
+  if (position <= 0) {
+    index = 0;
+    fractionQ16 = 0;
+    return;
+  }
+  if (position >= step * (int64_t)(count - 1)) {
+    // Last point: interpolate on the final interval, all the way at its end
+    index = count - 2;
+    fractionQ16 = 65536;
+    return;
+  }
+  index = (size_t)(position / step);
+  fractionQ16 = (uint32_t)(((position % step) << 16) / step);
+}
+
+template<size_t DOSES, size_t DURATIONS>
+void OffsetTable<DOSES, DURATIONS>::corners(int32_t doseMg, uint32_t grindMs, size_t &dose, size_t &duration, uint32_t weightsQ16[4]) const {
+  uint32_t doseFraction, durationFraction;
+  locate(doseMg, firstDoseMg, doseStepMg, DOSES, dose, doseFraction);
+  locate(grindMs, firstDurationMs, durationStepMs, DURATIONS, duration, durationFraction);
+  // Corners in the order [dose][duration], [dose][duration + 1], [dose + 1][duration], [dose + 1][duration + 1]
+  weightsQ16[0] = (uint32_t)(((uint64_t)(65536 - doseFraction) * (65536 - durationFraction)) >> 16);
+  weightsQ16[1] = (uint32_t)(((uint64_t)(65536 - doseFraction) * durationFraction) >> 16);
+  weightsQ16[2] = (uint32_t)(((uint64_t)doseFraction * (65536 - durationFraction)) >> 16);
+  weightsQ16[3] = (uint32_t)(((uint64_t)doseFraction * durationFraction) >> 16);
+}
+
+template<size_t DOSES, size_t DURATIONS>
+int32_t OffsetTable<DOSES, DURATIONS>::lookup(int32_t doseMg, uint32_t grindMs) const {
+  size_t dose, duration;
+  uint32_t weights[4];
+  corners(doseMg, grindMs, dose, duration, weights);
+  const int32_t (&offsets)[DOSES][DURATIONS] = state.offsets;
+  int64_t sum = (int64_t)offsets[dose][duration] * weights[0] + (int64_t)offsets[dose][duration + 1] * weights[1]
+                + (int64_t)offsets[dose + 1][duration] * weights[2] + (int64_t)offsets[dose + 1][duration + 1] * weights[3];
+  return (int32_t)((sum + (sum >= 0 ? 32768 : -32768)) / 65536);
+}
+
+template<size_t DOSES, size_t DURATIONS>
+void OffsetTable<DOSES, DURATIONS>::learn(int32_t doseMg, uint32_t grindMs, int32_t correction) {
+  int32_t target = lookup(doseMg, grindMs) + correction;
+  size_t dose, duration;
+  uint32_t weights[4];
+  corners(doseMg, grindMs, dose, duration, weights);
+
+  size_t doses[4] = {dose, dose, dose + 1, dose + 1};
+  size_t durations[4] = {duration, duration + 1, duration, duration + 1};
+  for (int i = 0; i < 4; i++) {
+    int32_t &offset = state.offsets[doses[i]][durations[i]];
+    uint8_t &shots = state.shots[doses[i]][durations[i]];
+    if (shots == 0) {
+      // Nothing learned here yet, start from this shot
+      offset = target;
+    } else {
+      offset += (int32_t)(((int64_t)(target - offset) * weights[i]) / 65536);
+    }
+    if (weights[i] >= LEARNED_WEIGHT_Q16 && shots < 255) {
+      shots++;
+    }
+  }
+
+  // Spread what is still missing at this point so the next shot here lands on target
+  int32_t residual = target - lookup(doseMg, grindMs);
+  int64_t weightSquares = 0;
+  for (int i = 0; i < 4; i++) {
+    weightSquares += ((int64_t)weights[i] * weights[i]) >> 16;
+  }
+  for (int i = 0; i < 4; i++) {
+    state.offsets[doses[i]][durations[i]] += (int32_t)((int64_t)residual * weights[i] / weightSquares);
+  }
+  fillUnlearned();
+}
+
+template<size_t DOSES, size_t DURATIONS>
+void OffsetTable<DOSES, DURATIONS>::fillUnlearned() {
+  for (size_t i = 0; i < DOSES; i++) {
+    for (size_t j = 0; j < DURATIONS; j++) {
+      if (state.shots[i][j] > 0) {
+        continue;
+      }
+      size_t bestDistance = SIZE_MAX;
+      for (size_t k = 0; k < DOSES; k++) {
+        for (size_t l = 0; l < DURATIONS; l++) {
+          size_t distance = (k > i ? k - i : i - k) + (l > j ? l - j : j - l);
+          if (state.shots[k][l] > 0 && distance < bestDistance) {
+            bestDistance = distance;
+            state.offsets[i][j] = state.offsets[k][l];
+          }
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <Crc32.h>
+
+// Fixed-size records appended to a ring of SLOTS slots in some storage, the oldest
+// overwritten first. Each slot carries its record's sequence number and a CRC, so
+// the ring is found again after a reset and a record torn by one doesn't count.
+//
+// Storage needs bool read(size_t offset, void *data, size_t length) and the same
+// for write, over at least bytes(). Slots are written one at a time and in order,
+// so storage may keep them as appends and start a stretch of slots over when the
+// ring comes back round to it; slots it doesn't have should fail to read, and
+// count as empty. Nothing is kept in RAM but where the ring
+// starts: every STRIDE-th slot is a sparse index into it, and a binary search
+// over those finds the newest record at load() in a few reads. After that a
+// sequence number maps straight to its slot.
+template<typename Record, size_t SLOTS, size_t STRIDE, typename Storage> class RecordRing {
+public:
+	static_assert(STRIDE >= 1 && SLOTS % STRIDE == 0, "the index needs a whole number of strides");
+
+	explicit RecordRing(Storage &storage) : storage(storage), head(0), next(1) {}
+
+	static constexpr size_t bytes() { return SLOTS * sizeof(Slot); }
+	static constexpr size_t slotBytes() { return sizeof(Slot); }
+
+	// Finds the newest record in storage, appends go after it
+	void load();
+	// Stores record as sequence nextSequence(), false if the storage write failed
+	bool append(const Record &record);
+	// Copies out the records numbered first to first + maxCount - 1 that are still there
+	// and intact, oldest first, returns how many
+	size_t read(uint32_t first, Record *records, size_t maxCount) const;
+
+	uint32_t nextSequence() const { return next; }
+	uint32_t oldestSequence() const { return next > SLOTS ? next - SLOTS : 1; }
+
+private:
+	struct __attribute__((packed)) Slot {
+		uint32_t sequence; // from 1, erased flash reads as 0 or ~0
+		Record record;
+		uint32_t crc;      // over sequence and record
+	};
+
+	// The slot's sequence number, 0 when it is empty or torn
+	uint32_t sequenceAt(size_t slot) const;
+
+	Storage &storage;
+	size_t head;   // slot the next record goes into
+	uint32_t next; // sequence number of the next record
+};
+
+#include "RecordRing.tpp"
@@ -0,0 +1,89 @@
+#include "RecordRing.h"
+
+template<typename Record, size_t SLOTS, size_t STRIDE, typename Storage>
+uint32_t RecordRing<Record, SLOTS, STRIDE, Storage>::sequenceAt(size_t slot) const {
+  Slot stored;
+  if (!storage.read(slot * sizeof(Slot), &stored, sizeof(Slot))) {
+    return 0;
+  }
+  if (stored.sequence == 0 || stored.crc != crc32(&stored, offsetof(Slot, crc))) {
+    return 0;
+  }
+  return stored.sequence;
+}
+
+template<typename Record, size_t SLOTS, size_t STRIDE, typename Storage>
+void RecordRing<Record, SLOTS, STRIDE, Storage>::load() {
+  head = 0;
+  next = 1;
+
+  // Records go in slot order, so from slot 0 up the sequence numbers rise until the
+  // newest record, then drop to the oldest ones (or to empty slots before the first wrap,
+  // or in a stretch the storage started over)
+  uint32_t first = sequenceAt(0);
+  if (first == 0) {
+    // Empty, or the newest record was torn on its way into slot 0
+    uint32_t last = sequenceAt(SLOTS - 1);
+    if (last != 0) {
+      next = last + 1;
+    }
+    return;
+  }
+
+  // Last index entry still at or after slot 0's record
+  size_t low = 0;
+  size_t high = SLOTS / STRIDE;
+  while (high - low > 1) {
+    size_t middle = low + (high - low) / 2;
+    if (sequenceAt(middle * STRIDE) >= first) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+
+  // The newest record is within that stride
+  size_t newest = low * STRIDE;
+  uint32_t newestSequence = sequenceAt(newest);
+  for (size_t slot = newest + 1; slot < (low + 1) * STRIDE; slot++) {
+    uint32_t sequence = sequenceAt(slot);
+    if (sequence != newestSequence + 1) {
+      break;
+    }
+    newest = slot;
+    newestSequence = sequence;
+  }
+  head = (newest + 1) % SLOTS;
+  next = newestSequence + 1;
+}
+
+template<typename Record, size_t SLOTS, size_t STRIDE, typename Storage>
+bool RecordRing<Record, SLOTS, STRIDE, Storage>::append(const Record &record) {
+  Slot slot;
+  slot.sequence = next;
+  slot.record = record;
+  slot.crc = crc32(&slot, offsetof(Slot, crc));
+  if (!storage.write(head * sizeof(Slot), &slot, sizeof(Slot))) {
+    return false;
+  }
+  head = (head + 1) % SLOTS;
+  next += 1;
+  return true;
+}
+
+template<typename Record, size_t SLOTS, size_t STRIDE, typename Storage>
+size_t RecordRing<Record, SLOTS, STRIDE, Storage>::read(uint32_t first, Record *records, size_t maxCount) const {
+  size_t count = 0;
+  uint32_t last = first + maxCount < next ? first + maxCount : next;
+  for (uint32_t sequence = first > oldestSequence() ? first : oldestSequence(); sequence < last; sequence++) {
+    // Counted back from the head, the newest record sits just before it
+    size_t slot = (head + SLOTS - (next - sequence)) % SLOTS;
+    Slot stored;
+    if (!storage.read(slot * sizeof(Slot), &stored, sizeof(Slot)) || stored.sequence != sequence ||
+        stored.crc != crc32(&stored, offsetof(Slot, crc))) {
+      continue;
+    }
+    records[count++] = stored.record;
+  }
+  return count;
+}
@@ -0,0 +1,48 @@
+#include "BiquadNotch.h"
+#include <math.h>
+
+BiquadNotch::BiquadNotch() : b0(0), b1(0), a1(0), a2(0), x1(0), x2(0), y1(0), y2(0), active(false), primed(false) {
+}
+
+void BiquadNotch::tune(uint32_t frequencyQ16, uint32_t poleRadiusQ16) {
+  // Coefficients only change on a retune, so they are worked out in float
+  float c = cosf(2 * (float)M_PI * frequencyQ16 / 65536);
+  float r = poleRadiusQ16 / 65536.0f;
+  float gain = (1 - 2 * r * c + r * r) / (2 - 2 * c);
+  float scale = (float)(1L << COEFFICIENT_BITS);
+
+  b0 = (int32_t)lroundf(gain * scale);
+  b1 = (int32_t)lroundf(-2 * c * gain * scale);
+  a1 = (int32_t)lroundf(-2 * r * c * scale);
+  a2 = (int32_t)lroundf(r * r * scale);
+  if (!active) {
+    // Start from the next reading instead of ringing up from zero
+    primed = false;
+  }
+  active = true;
+}
+
+void BiquadNotch::disable() {
+  active = false;
+}
+
+int32_t BiquadNotch::filter(int32_t value) {
+  if (!active) {
+    return value;
+  }
+  if (!primed) {
+    x1 = x2 = value;
+    y1 = y2 = (int64_t)value << STATE_FRACTION_BITS;
+    primed = true;
+  }
+
+  int64_t accumulator = (((int64_t)b0 * value + (int64_t)b1 * x1 + (int64_t)b0 * x2) << STATE_FRACTION_BITS)
+                        - (int64_t)a1 * y1 - (int64_t)a2 * y2;
+  int64_t output = (accumulator + (1LL << (COEFFICIENT_BITS - 1))) >> COEFFICIENT_BITS;
+
+  x2 = x1;
+  x1 = value;
+  y2 = y1;
+  y1 = output;
+  return (int32_t)((output + (1 << (STATE_FRACTION_BITS - 1))) >> STATE_FRACTION_BITS);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+// Second-order IIR notch in integer math: zeros on the unit circle at the
+// notch frequency, poles just inside at the same angle. The pole radius sets
+// the width, roughly (1 - radius) / pi cycles per reading between the -3 dB
+// points. Gain is normalised to one at DC so a weight passes unchanged.
+// Disabled, it passes readings straight through.
+class BiquadNotch {
+public:
+	BiquadNotch();
+
+	// frequency in cycles per reading, Q16 (below 32768); radius in Q16 (below 65536)
+	void tune(uint32_t frequencyQ16, uint32_t poleRadiusQ16);
+	void disable();
+	bool enabled() const { return active; }
+
+	int32_t filter(int32_t value);
+
+private:
+	static constexpr int COEFFICIENT_BITS = 28;
+	static constexpr int STATE_FRACTION_BITS = 8; // extra output bits fed back, as in FixedKalmanFilter
+
+	int32_t b0, b1, a1, a2; // b2 == b0
+	int32_t x1, x2;
+	int64_t y1, y2;
+	bool active;
+	bool primed;
+};
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+// Finds the strongest vibration line in a stream of readings. Every N / 2
+// readings it takes a Hann-windowed fixed-point FFT over the last N readings.
+// The readings are first differenced, so a steady ramp (the grind itself) drops
+// out and doesn't leak into the low bins. A peak counts when it stands
+// `prominence` times above the mean power of the other bins at or above minBin
+// and is at least minAmplitude (input units, peak) strong.
+template<size_t N> class SpectrumEstimator {
+public:
+	static_assert(N >= 16 && (N & (N - 1)) == 0, "block must be a power of two");
+
+	SpectrumEstimator(size_t minBin, uint32_t prominence, int32_t minAmplitude);
+
+	// Returns true when the reading completed a block and the peak was re-estimated
+	bool push(int32_t value);
+	void reset();
+
+	bool hasPeak() const { return peakFound; }
+	// Frequency of the last peak in cycles per reading, Q16 (below 32768)
+	uint32_t peakFrequencyQ16() const { return frequencyQ16; }
+	int32_t peakAmplitude() const { return amplitude; }
+
+private:
+	// Differences beyond this are clipped, which keeps the transform inside 32 bits
+	static constexpr int32_t INPUT_LIMIT = 1 << 20;
+
+	void analyze();
+	void transform();
+
+	int16_t cosTable[N / 2]; // Q15
+	int16_t sinTable[N / 2];
+	int16_t hannTable[N];
+
+	int32_t differences[N]; // arrival order, ring
+	int32_t re[N];
+	int32_t im[N];
+	int64_t power[N / 2 + 1]; // bins 0..N/2
+	int32_t lastValue;
+	size_t head;
+	size_t count;
+	size_t sinceAnalysis;
+
+	size_t minBin;
+	uint32_t prominence;
+	int32_t minAmplitude;
+
+	bool peakFound;
+	uint32_t frequencyQ16;
+	int32_t amplitude;
+};
+
+#include "SpectrumEstimator.tpp"
@@ -0,0 +1,146 @@
+#include "SpectrumEstimator.h"
+
+template<size_t N>
+SpectrumEstimator<N>::SpectrumEstimator(size_t minBin, uint32_t prominence, int32_t minAmplitude) :
+		lastValue(0), head(0), count(0), sinceAnalysis(0), minBin(minBin < 2 ? 2 : minBin),
+		prominence(prominence), minAmplitude(minAmplitude), peakFound(false), frequencyQ16(0), amplitude(0) {
+  // Tables are built once, the transform itself is integer only
+  for (size_t k = 0; k < N / 2; k++) {
+    cosTable[k] = (int16_t)lroundf(32767 * cosf(2 * (float)M_PI * k / N));
+    sinTable[k] = (int16_t)lroundf(32767 * sinf(2 * (float)M_PI * k / N));
+  }
+  for (size_t n = 0; n < N; n++) {
+    hannTable[n] = (int16_t)lroundf(32767 * 0.5f * (1 - cosf(2 * (float)M_PI * n / N)));
+  }
+}
+
+template<size_t N>
+void SpectrumEstimator<N>::reset() {
+  head = 0;
+  count = 0;
+  sinceAnalysis = 0;
+  peakFound = false;
+  frequencyQ16 = 0;
+  amplitude = 0;
+}
+
+template<size_t N>
+bool SpectrumEstimator<N>::push(int32_t value) {
+  if (count == 0 && sinceAnalysis == 0) {
+    lastValue = value;
+  }
+  int32_t difference = value - lastValue;
+  lastValue = value;
+  if (difference > INPUT_LIMIT) {
+    difference = INPUT_LIMIT;
+  } else if (difference < -INPUT_LIMIT) {
+    difference = -INPUT_LIMIT;
+  }
+
+  differences[head] = difference;
+  head = (head + 1) % N;
+  if (count < N) {
+    count++;
+  }
+  sinceAnalysis++;
+
+  if (count < N || sinceAnalysis < N / 2) {
+    return false;
+  }
+  sinceAnalysis = 0;
+  analyze();
+  return true;
+}
+
+template<size_t N>
+void SpectrumEstimator<N>::transform() {
+  // In-place iterative radix-2 decimation in time
+  for (size_t i = 1, j = 0; i < N; i++) {
+    size_t bit = N >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      int32_t swap = re[i]; re[i] = re[j]; re[j] = swap;
+      swap = im[i]; im[i] = im[j]; im[j] = swap;
+    }
+  }
+
+  for (size_t length = 2; length <= N; length <<= 1) {
+    size_t stride = N / length;
+    for (size_t start = 0; start < N; start += length) {
+      for (size_t k = 0; k < length / 2; k++) {
+        int32_t wr = cosTable[k * stride];
+        int32_t wi = -sinTable[k * stride];
+        size_t a = start + k;
+        size_t b = a + length / 2;
+        int32_t tr = (int32_t)(((int64_t)re[b] * wr - (int64_t)im[b] * wi) >> 15);
+        int32_t ti = (int32_t)(((int64_t)re[b] * wi + (int64_t)im[b] * wr) >> 15);
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
+
+template<size_t N>
+void SpectrumEstimator<N>::analyze() {
+  for (size_t n = 0; n < N; n++) {
+    re[n] = (int32_t)(((int64_t)differences[(head + n) % N] * hannTable[n]) >> 15);
+    im[n] = 0;
+  }
+  transform();
+
+  for (size_t k = 0; k <= N / 2; k++) {
+    power[k] = (int64_t)re[k] * re[k] + (int64_t)im[k] * im[k];
+  }
+
+  size_t peak = minBin;
+  for (size_t k = minBin; k < N / 2; k++) {
+    if (power[k] > power[peak]) {
+      peak = k;
+    }
+  }
+
+  // Mean power of the band without the peak and its Hann main lobe
+  int64_t otherPower = 0;
+  size_t others = 0;
+  for (size_t k = minBin; k <= N / 2; k++) {
+    if (k + 1 < peak || k > peak + 1) {
+      otherPower += power[k];
+      others++;
+    }
+  }
+  if (others == 0 || power[peak] <= (otherPower / (int64_t)others) * prominence) {
+    peakFound = false;
+    return;
+  }
+
+  // Refined once per block: parabola through the peak's magnitude and its neighbours
+  float left = sqrtf((float)power[peak - 1]);
+  float center = sqrtf((float)power[peak]);
+  float right = sqrtf((float)power[peak + 1]);
+  float curvature = left - 2 * center + right;
+  float offset = curvature < 0 ? 0.5f * (left - right) / curvature : 0;
+  if (offset > 0.5f) {
+    offset = 0.5f;
+  } else if (offset < -0.5f) {
+    offset = -0.5f;
+  }
+  float cyclesPerReading = (peak + offset) / N;
+
+  // A Hann-windowed sine of amplitude A peaks at A * N / 4; differencing scaled it by 2 sin(pi f)
+  float differenceAmplitude = (center - 0.25f * (left - right) * offset) * 4 / N;
+  float lineAmplitude = differenceAmplitude / (2 * sinf((float)M_PI * cyclesPerReading));
+  if (lineAmplitude < minAmplitude) {
+    peakFound = false;
+    return;
+  }
+
+  peakFound = true;
+  frequencyQ16 = (uint32_t)lroundf(cyclesPerReading * 65536);
+  amplitude = (int32_t)lroundf(lineAmplitude);
+}
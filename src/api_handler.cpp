@@ -1,5 +1,6 @@
 #include "api_handler.hpp"
 #include "config.hpp"
+#include "settings.hpp"
 
 extern Preferences preferences;
 
@@ -23,6 +24,7 @@ void setupApiEndpoints(AsyncWebServer& server) {
 
             request->send(200, "text/html", "<h1>Wi-Fi Saved. Restarting...</h1>");
             delay(3000);
+            flushSettings();
             ESP.restart(); // Restart ESP32 to apply new Wi-Fi settings
         } else {
             request->send(400, "text/plain", "Missing Wi-Fi credentials");
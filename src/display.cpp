@@ -1,6 +1,10 @@
 #include "config.hpp"
 #include "rotary.hpp"
 #include "web_server.hpp"
+#include "recorder.hpp"
+#include "scale.hpp"
+#include "settings.hpp"
+#include "shotlog.hpp"
 
 U8G2_SSD1306_128X64_NONAME_F_HW_I2C screen(U8G2_R0);
 TaskHandle_t DisplayTask;
@@ -57,29 +61,35 @@ void showIPAddress() {
 // Menu items for user interface
 int currentMenuItem = 0;      // Index of the current menu item
 int currentSetting;           // Index of the current setting being adjusted
-int menuItemsCount = debugMode ? 10 : 9;       // Total number of menu items
+int menuItemsCount = debugMode ? 11 : 10;       // Total number of menu items
 
  // Menu items for settings and calibration
-MenuItem menuItems[10] = {
-    {0, false, "Cup weight", 1, &setCupWeight},
+MenuItem menuItems[11] = {
+    {0, false, "Cup weight", MG_PER_GRAM, &setCupWeight},
     {1, false, "Calibrate", 0},
-    {2, false, "Offset", 0.1, &offset},
+    {2, false, "Offset", MG_PER_GRAM / 10, &offset},
     {3, false, "Scale Mode", 0},
     {4, false, "Grinding Mode", 0},
     {5, false, "Info Menu", 0},
     {6, false, "Grind Trigger", 0},
-    {7, false, "Exit", 0},
-    {8, false, "Reset", 0},
+    {7, false, "Top Up", 0},
+    {8, false, "Exit", 0},
+    {9, false, "Reset", 0},
     // Debug menu placeholder (conditional)
-    {9, false, "Debug Menu", 0} // Visible only if debugMode is true
+    {10, false, "Debug Menu", 0} // Visible only if debugMode is true
 };
 
-int debugMenuItemsCount = 3; // Number of items in the Debug Menu
+int debugMenuItemsCount = 8; // Number of items in the Debug Menu
 int currentDebugMenuItem = 0; // Current selection in the Debug Menu
-MenuItem debugMenuItems[3] = {
+MenuItem debugMenuItems[8] = {
     {0, false, "Sim Grind", 0},
     {1, false, "Weight Hist", 0},
-    {2, false, "Zero Shot Count", 0}
+    {2, false, "Zero Shot Count", 0},
+    {3, false, "Dump Samples", 0},
+    {4, false, "Outliers", 0},
+    {5, false, "Transitions", 0},
+    {6, false, "Shot Log", 0},
+    {7, false, "Exit", 0}
 };
 
 void showDebugMenu()
@@ -112,9 +122,9 @@ void showDebugMenu()
 
 void setupMenuItems() {
     if (debugMode) {
-        menuItemsCount = 10; // Include Debug Menu
+        menuItemsCount = 11; // Include Debug Menu
     } else {
-        menuItemsCount = 9; // Exclude Debug Menu
+        menuItemsCount = 10; // Exclude Debug Menu
     }
 }
 
@@ -122,7 +132,7 @@ void wakeScreen() {
     // Reset the sleep timer and update the display
     lastSignificantWeightChangeAt = millis();
     screenJustWoke = true; // Indicate that the screen just woke up
-    scaleStatus = STATUS_EMPTY;
+    setScaleStatus(STATUS_EMPTY);
     screen.clearBuffer();
     screen.sendBuffer();
 }
@@ -181,7 +191,7 @@ void showOffsetMenu()
   screen.setFont(u8g2_font_7x14B_tf);           // Set the font for the menu title
   CenterPrintToScreen("Adjust offset", 0);      // Print the menu title
   screen.setFont(u8g2_font_7x13_tr);            // Set the font for the offset value
-  snprintf(buf, sizeof(buf), "%3.2fg", offset); // Format the offset value
+  snprintf(buf, sizeof(buf), "%3.2fg", mgToGrams(offset)); // Format the offset value
   CenterPrintToScreen(buf, 28);                 // Print the offset value
   screen.sendBuffer();                          // Send the buffer to the display
 }
@@ -229,6 +239,27 @@ void showGrindModeMenu()
   screen.sendBuffer(); // Send the buffer to the display
 }
 
+// Function to display the top-up mode menu
+void showTopUpMenu()
+{
+  screen.clearBuffer();
+  screen.setFontPosTop();
+  screen.setFont(u8g2_font_7x14B_tf);     // Set the font for the menu title
+  CenterPrintToScreen("Set Top Up", 0);   // Print the menu title
+  screen.setFont(u8g2_font_7x13_tr);      // Set the font for the menu items
+  if (topUpMode)
+  {
+    LeftPrintToScreen("Off", 19);                 // Print inactive item
+    LeftPrintActiveToScreen("Pulse to dose", 35); // Highlight active item
+  }
+  else
+  {
+    LeftPrintActiveToScreen("Off", 19);     // Highlight active item
+    LeftPrintToScreen("Pulse to dose", 35); // Print inactive item
+  }
+  screen.sendBuffer(); // Send the buffer to the display
+}
+
 // Function to display the cup weight adjustment menu
 void showCupMenu()
 {
@@ -238,21 +269,21 @@ void showCupMenu()
   screen.setFont(u8g2_font_7x14B_tf);                // Set the font for the menu title
   CenterPrintToScreen("Cup Weight", 0);              // Print the menu title
   screen.setFont(u8g2_font_7x13_tr);                 // Set the font for the instructions
-  snprintf(buf, sizeof(buf), "%3.1fg", scaleWeight); // Format the scale weight
+  snprintf(buf, sizeof(buf), "%3.1fg", mgToGrams(scaleWeight)); // Format the scale weight
   CenterPrintToScreen(buf, 19);                      // Print the scale weight
   LeftPrintToScreen("Place cup on scale", 35);       // Print instructions
   LeftPrintToScreen("and press button", 51);         // Print instructions
   screen.sendBuffer();                               // Send the buffer to the display
 }
 
-void showCupWeightSetScreen(double cupWeight)
+void showCupWeightSetScreen(int32_t cupWeight)
 {
   char buf[32];
   screen.clearBuffer();
   screen.setFontPosTop();
   screen.setFont(u8g2_font_7x14B_tf);
   CenterPrintToScreen("Cup Weight Set:", 0);
-  snprintf(buf, sizeof(buf), "%3.1fg", cupWeight);
+  snprintf(buf, sizeof(buf), "%3.1fg", mgToGrams(cupWeight));
   CenterPrintToScreen(buf, 20); // Center the message on the screen
 
   screen.sendBuffer();
@@ -374,40 +405,72 @@ void showSetting()
   else if (currentSetting == 9) {
     showDebugMenu();
   }
+  else if (currentSetting == 10)
+  {
+    showTopUpMenu();
+  }
 
 }
 
+// Shows the grinding screen for 5 seconds; the grind state machine leaves it alone
+void simulateGrinding()
+{
+    Serial.println("Simulating Grinding...");
+    grindSimulated = true;
+    setScaleStatus(STATUS_GRINDING_IN_PROGRESS);
+    startedGrindingAt = millis();
+    cupWeightEmpty = 5000; // Example cup weight
+    delay(5000);
+    setScaleStatus(STATUS_IN_SUBMENU); // Return to Debug Menu state
+    grindSimulated = false;
+}
+
 void handleDebugMenuAction()
 {
     switch (currentDebugMenuItem)
     {
     case 0: // Simulate Grinding
-        Serial.println("Simulating Grinding...");
-        scaleStatus = STATUS_GRINDING_IN_PROGRESS; // Temporarily change the state for grinding simulation
-        startedGrindingAt = millis();
-        setWeight = 20.0;     // Example weight
-        cupWeightEmpty = 5.0; // Example cup weight
-        delay(5000);          // Simulate grinding for 5 seconds
-        scaleStatus = STATUS_IN_SUBMENU; // Return to Debug Menu state
+        simulateGrinding();
         currentSetting = 9;
         exitToMenu();
         break;
 
     case 1: // Show Weight History
+    {
         Serial.println("Displaying Weight History...");
-        // Add logic to display weight history
+        // One consistent snapshot of the last 10 seconds, the scale task keeps sampling meanwhile
+        struct HistorySummary { int32_t average, min, max; size_t count; };
+        HistorySummary history = weightHistory.read([](const WeightHistory &buffer) {
+            int64_t cutoff = (int64_t)millis() - 10000;
+            return HistorySummary{buffer.averageSince(cutoff), buffer.minSince(cutoff), buffer.maxSince(cutoff), buffer.countSamplesSince(cutoff)};
+        });
+        char buf[32];
+        displayLock = true;
+        screen.clearBuffer();
+        screen.setFontPosTop();
+        screen.setFont(u8g2_font_7x13_tr);
+        snprintf(buf, sizeof(buf), "Avg: %3.1fg", mgToGrams(history.average));
+        LeftPrintToScreen(buf, 0);
+        snprintf(buf, sizeof(buf), "Min: %3.1fg", mgToGrams(history.min));
+        LeftPrintToScreen(buf, 16);
+        snprintf(buf, sizeof(buf), "Max: %3.1fg", mgToGrams(history.max));
+        LeftPrintToScreen(buf, 32);
+        snprintf(buf, sizeof(buf), "Samples: %u", (unsigned)history.count);
+        LeftPrintToScreen(buf, 48);
+        screen.sendBuffer();
+        delay(3000);
+        displayLock = false;
         // Keep in the Debug Menu
-        scaleStatus = STATUS_IN_SUBMENU;
+        setScaleStatus(STATUS_IN_SUBMENU);
         currentSetting = 9;
         exitToMenu();
         break;
+    }
 
     case 2: // Reset Shot Count
       Serial.println("Resetting Shot Count...");
       shotCount = 0;
-      preferences.begin("scale", false);
-      preferences.putUInt("shotCount", shotCount);
-      preferences.end();
+      saveSettings();
       // Show confirmation message
       displayLock = true;
       screen.clearBuffer();
@@ -418,12 +481,100 @@ void handleDebugMenuAction()
       displayLock = false;
 
       // Stay in the Debug Menu
-      scaleStatus = STATUS_IN_SUBMENU;
+      setScaleStatus(STATUS_IN_SUBMENU);
       currentSetting = 9;
       exitToMenu();
       break;
 
-    case 3: // Exit Debug Menu
+    case 3: // Dump the raw sample recording over serial for host replay
+      Serial.println("Dumping raw samples...");
+      displayLock = true;
+      screen.clearBuffer();
+      screen.setFont(u8g2_font_7x14B_tf);
+      CenterPrintToScreen("Dumping...", 32);
+      screen.sendBuffer();
+      dumpRecording();
+      displayLock = false;
+
+      // Stay in the Debug Menu
+      setScaleStatus(STATUS_IN_SUBMENU);
+      currentSetting = 9;
+      exitToMenu();
+      break;
+
+    case 4: // Show how many readings the outlier stage replaced since boot
+    {
+        char buf[32];
+        displayLock = true;
+        screen.clearBuffer();
+        screen.setFontPosTop();
+        screen.setFont(u8g2_font_7x13_tr);
+        LeftPrintToScreen("Rejected samples", 0);
+        snprintf(buf, sizeof(buf), "%lu", (unsigned long)rejectedSamples);
+        LeftPrintToScreen(buf, 24);
+        screen.sendBuffer();
+        delay(3000);
+        displayLock = false;
+
+        // Keep in the Debug Menu
+        setScaleStatus(STATUS_IN_SUBMENU);
+        currentSetting = 9;
+        exitToMenu();
+        break;
+    }
+
+    case 5: // Print the grind state machine's transitions, show the slowest decision
+    {
+        char buf[32];
+        int from = 0, to = 0;
+        printTransitionStats();
+        displayLock = true;
+        screen.clearBuffer();
+        screen.setFontPosTop();
+        screen.setFont(u8g2_font_7x13_tr);
+        LeftPrintToScreen("Slowest decision", 0);
+        if (worstTransition(from, to)) {
+            snprintf(buf, sizeof(buf), "%d -> %d", from, to);
+            LeftPrintToScreen(buf, 16);
+            snprintf(buf, sizeof(buf), "%lu us", (unsigned long)transitionStats(from, to).worstLatencyUs);
+            LeftPrintToScreen(buf, 32);
+        } else {
+            LeftPrintToScreen("none yet", 16);
+        }
+        screen.sendBuffer();
+        delay(3000);
+        displayLock = false;
+
+        // Keep in the Debug Menu
+        setScaleStatus(STATUS_IN_SUBMENU);
+        currentSetting = 9;
+        exitToMenu();
+        break;
+    }
+
+    case 6: // Print the latest shots from the shot log, show how many are stored
+    {
+        char buf[32];
+        printShotLog(20);
+        displayLock = true;
+        screen.clearBuffer();
+        screen.setFontPosTop();
+        screen.setFont(u8g2_font_7x13_tr);
+        LeftPrintToScreen("Shots logged", 0);
+        snprintf(buf, sizeof(buf), "%lu", (unsigned long)(nextShotSequence() - 1));
+        LeftPrintToScreen(buf, 24);
+        screen.sendBuffer();
+        delay(3000);
+        displayLock = false;
+
+        // Keep in the Debug Menu
+        setScaleStatus(STATUS_IN_SUBMENU);
+        currentSetting = 9;
+        exitToMenu();
+        break;
+    }
+
+    case 7: // Exit Debug Menu
       Serial.println("Exiting Debug Menu...");
       exitToMenu(); // Return to Main Menu
       break;
@@ -437,6 +588,7 @@ void updateDisplay(void *parameter)
 {
   char buf[64];
   char buf2[64];
+  bool asleep = false;
 
   for (;;)
   {
@@ -451,10 +603,16 @@ void updateDisplay(void *parameter)
     if (millis() - lastSignificantWeightChangeAt > sleepTime)
     {
       screen.sendBuffer(); // Send the buffer to the display to "sleep"
+      if (!asleep)
+      {
+        asleep = true;
+        flushSettings(); // Nothing gets dialled in while asleep, don't leave it for later
+        setScaleStatus(STATUS_EMPTY);
+      }
       delay(100);
-      scaleStatus = STATUS_EMPTY;
       continue;
     }
+    asleep = false;
 
     if (scaleLastUpdatedAt == 0)
     {
@@ -468,16 +626,16 @@ void updateDisplay(void *parameter)
     }
     else
     {
-      if (scaleStatus == STATUS_GRINDING_IN_PROGRESS)
+      if (scaleStatus == STATUS_GRINDING_IN_PROGRESS || scaleStatus == STATUS_TOPPING_UP)
       {
         screen.setFontPosTop();
         screen.setFont(u8g2_font_7x13_tr);
-        CenterPrintToScreen("Grinding...", 0);
+        CenterPrintToScreen(scaleStatus == STATUS_TOPPING_UP ? "Topping up..." : "Grinding...", 0);
 
         screen.setFontPosCenter();
         screen.setFont(u8g2_font_7x14B_tf);
         screen.setCursor(3, 32);
-        snprintf(buf, sizeof(buf), "%3.1fg", scaleWeight - cupWeightEmpty);
+        snprintf(buf, sizeof(buf), "%3.1fg", mgToGrams(scaleWeight - cupWeightEmpty));
         screen.print(buf);
 
         screen.setFontPosCenter();
@@ -487,7 +645,7 @@ void updateDisplay(void *parameter)
         screen.setFontPosCenter();
         screen.setFont(u8g2_font_7x14B_tf);
         screen.setCursor(84, 32);
-        snprintf(buf, sizeof(buf), "%3.1fg", setWeight);
+        snprintf(buf, sizeof(buf), "%3.1fg", mgToGrams(setWeight));
         screen.print(buf);
 
         screen.setFontPosBottom();
@@ -504,13 +662,13 @@ void updateDisplay(void *parameter)
         screen.setFont(u8g2_font_7x14B_tf);
         screen.setFontPosCenter();
         screen.setCursor(0, 28);
-        snprintf(buf, sizeof(buf), "%3.1fg", abs(scaleWeight));
+        snprintf(buf, sizeof(buf), "%3.1fg", mgToGrams(abs(scaleWeight)));
         CenterPrintToScreen(buf, 32);
 
         screen.setFont(u8g2_font_7x13_tf);
         screen.setFontPosCenter();
         screen.setCursor(5, 50);
-        snprintf(buf2, sizeof(buf2), "Set: %3.1fg", abs(setWeight));
+        snprintf(buf2, sizeof(buf2), "Set: %3.1fg", mgToGrams(abs(setWeight)));
         LeftPrintToScreen(buf2, 50);
       }
       else if (scaleStatus == STATUS_GRINDING_FAILED)
@@ -534,7 +692,7 @@ void updateDisplay(void *parameter)
         screen.setFontPosCenter();
         screen.setFont(u8g2_font_7x14B_tf);
         screen.setCursor(3, 32);
-        snprintf(buf, sizeof(buf), "%3.1fg", scaleWeight - cupWeightEmpty);
+        snprintf(buf, sizeof(buf), "%3.1fg", mgToGrams(scaleWeight - cupWeightEmpty));
         screen.print(buf);
 
         screen.setFontPosCenter();
@@ -544,7 +702,7 @@ void updateDisplay(void *parameter)
         screen.setFontPosCenter();
         screen.setFont(u8g2_font_7x14B_tf);
         screen.setCursor(84, 32);
-        snprintf(buf, sizeof(buf), "%3.1fg", setWeight);
+        snprintf(buf, sizeof(buf), "%3.1fg", mgToGrams(setWeight));
         screen.print(buf);
 
         screen.setFontPosBottom();
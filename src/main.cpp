@@ -7,14 +7,18 @@
 #include "scale.hpp"
 #include "config.hpp"
 #include "web_server.hpp"
+#include "shotlog.hpp"
 
 // Definitions of global variables (memory allocated here)
 Preferences preferences;             // Preferences object
 HX711 loadcell;                      // HX711 load cell object
-SimpleKalmanFilter kalmanFilter(0.02, 0.02, 0.01); // Kalman filter for weight smoothing
+FixedKalmanFilter kalmanFilter(FILTER_MEASUREMENT_ERROR, FILTER_MEASUREMENT_ERROR, FIXED_Q16(0.1)); // Kalman filter for weight smoothing (mg)
 
 TaskHandle_t ScaleTask = nullptr;    // Initialize task handles to nullptr
 TaskHandle_t ScaleStatusTask = nullptr;
+TaskHandle_t RotaryTask = nullptr;
+TaskHandle_t SettingsTask = nullptr;
+TaskHandle_t ShotLogTask = nullptr;
 
 volatile bool displayLock = false; 
 
@@ -23,6 +27,7 @@ void setup() {
     
     // Setup other components
     setupDisplay();
+    setupShotLog();
     setupScale();
     setupWebServer();
 }
@@ -0,0 +1,143 @@
+#include "config.hpp"
+#include "recorder.hpp"
+
+// The most recent raw readings, kept so a field problem can be dumped over serial
+// and replayed on the host through the same zero, filter and state machine
+struct RecordedSample {
+    uint32_t timestampUs; // low 32 bits of esp_timer, only differences matter
+    int32_t counts;       // raw HX711 counts, before zeroScaleReading
+};
+
+// What moved the zero between readings: a chip temperature reading, with the zero and
+// drift slope it left behind, or a tare seen pending for the first time
+struct RecordedEvent {
+    uint32_t timestampUs; // of the reading it came before
+    bool tare;
+    float celsius;
+    int32_t zeroCounts;
+    float countsPerDegree;
+};
+
+static RecordedSample recording[RECORDING_SAMPLES];
+static size_t recordingHead = 0; // Slot the next sample goes into
+static size_t recordingCount = 0;
+static RecordedEvent events[RECORDING_EVENTS];
+static size_t eventsHead = 0;
+static size_t eventsCount = 0;
+static bool tareRecorded = false; // The pending tare already has its event
+static volatile bool recordingPaused = false; // Set while dumping so the ring holds still
+
+static void recordEvent(const RecordedEvent &event)
+{
+    events[eventsHead] = event;
+    eventsHead = (eventsHead + 1) % RECORDING_EVENTS;
+    if (eventsCount < RECORDING_EVENTS) {
+        eventsCount++;
+    }
+}
+
+void recordRawSample(int32_t counts, int64_t timestampUs)
+{
+    if (recordingPaused) {
+        return;
+    }
+    // zeroScaleReading sees the tare flag with this reading, the replay sets it just before it
+    if (tarePending && !tareRecorded) {
+        recordEvent({(uint32_t)timestampUs, true, 0, 0, 0});
+    }
+    tareRecorded = tarePending;
+    recording[recordingHead] = {(uint32_t)timestampUs, counts};
+    recordingHead = (recordingHead + 1) % RECORDING_SAMPLES;
+    if (recordingCount < RECORDING_SAMPLES) {
+        recordingCount++;
+    }
+}
+
+void recordTemperature(float celsius, int64_t timestampUs)
+{
+    if (recordingPaused) {
+        return;
+    }
+    recordEvent({(uint32_t)timestampUs, false, celsius, scaleZeroCounts, driftCountsPerDegree});
+}
+
+size_t recordedSampleCount()
+{
+    return recordingCount;
+}
+
+void clearRecording()
+{
+    recordingPaused = true;
+    delay(20); // Let a sample already being written by the scale task land first
+    recordingHead = 0;
+    recordingCount = 0;
+    recordingPaused = false;
+}
+
+// Prints the settings the replay needs and the zero state at the first sample, then one
+// "<us since first sample> <raw counts>" line per sample with the temperature ("T <us> <celsius>")
+// and tare ("tare <us>") events in between
+void dumpRecording()
+{
+    recordingPaused = true;
+    delay(20);
+
+    size_t first = (recordingHead + RECORDING_SAMPLES - recordingCount) % RECORDING_SAMPLES;
+    size_t firstEvent = (eventsHead + RECORDING_EVENTS - eventsCount) % RECORDING_EVENTS;
+    uint32_t startUs = recording[first].timestampUs;
+    // The zero as the last temperature reading before the first sample left it. Without one
+    // the recording goes back to boot, before any drift correction.
+    int32_t zeroCounts = scaleZeroCounts;
+    float countsPerDegree = driftCountsPerDegree;
+    float celsius = referenceTemperature;
+    size_t skippedEvents = 0;
+    for (size_t i = 0; i < eventsCount; i++) {
+        const RecordedEvent &event = events[(firstEvent + i) % RECORDING_EVENTS];
+        if (recordingCount > 0 && (int32_t)(event.timestampUs - startUs) > 0) {
+            break;
+        }
+        if (!event.tare) {
+            zeroCounts = event.zeroCounts;
+            countsPerDegree = event.countsPerDegree;
+            celsius = event.celsius;
+            skippedEvents = i + 1;
+        }
+    }
+
+    Serial.println("# openGBW recording v2");
+    Serial.printf("# mgPerCountQ16=%ld offset=%ld setWeight=%ld setCupWeight=%ld grindMode=%d scaleMode=%d grindTrigger=%d stopDelay=%lu topUp=%d pulseRate=%lu\n",
+                  (long)mgPerCountQ16, (long)offset, (long)setWeight, (long)setCupWeight,
+                  grindMode ? 1 : 0, scaleMode ? 1 : 0, useButtonToGrind ? 1 : 0, (unsigned long)stopDelayMs,
+                  topUpMode ? 1 : 0, (unsigned long)pulseRateMgPerS);
+    Serial.printf("# zero=%ld drift=%.4f reference=%.2f celsius=%.2f\n",
+                  (long)zeroCounts, countsPerDegree, referenceTemperature, celsius);
+    // The learned offsets as the hex of their NVS blob
+    Serial.print("# offsetTable=");
+    const uint8_t *table = (const uint8_t *)offsetTable.data();
+    for (size_t i = 0; i < StopOffsetTable::bytes(); i++) {
+        Serial.printf("%02x", table[i]);
+    }
+    Serial.println();
+    size_t nextEvent = skippedEvents;
+    for (size_t i = 0; i < recordingCount; i++) {
+        const RecordedSample &sample = recording[(first + i) % RECORDING_SAMPLES];
+        uint32_t offsetUs = sample.timestampUs - startUs;
+        for (; nextEvent < eventsCount; nextEvent++) {
+            const RecordedEvent &event = events[(firstEvent + nextEvent) % RECORDING_EVENTS];
+            int32_t eventOffsetUs = (int32_t)(event.timestampUs - startUs);
+            if (eventOffsetUs > (int32_t)offsetUs) {
+                break;
+            }
+            if (event.tare) {
+                Serial.printf("tare %lu\n", (unsigned long)(eventOffsetUs > 0 ? eventOffsetUs : 0));
+            } else {
+                Serial.printf("T %lu %.2f\n", (unsigned long)eventOffsetUs, event.celsius);
+            }
+        }
+        Serial.printf("%lu %ld\n", (unsigned long)offsetUs, (long)sample.counts);
+    }
+    Serial.println("# end");
+
+    recordingPaused = false;
+}
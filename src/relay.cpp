@@ -0,0 +1,163 @@
+#include <esp_timer.h>
+#include <algorithm>
+#include <atomic>
+#include "config.hpp"
+#include "relay.hpp"
+
+// The grinder relay. In continuous mode it is the motor switch; in impulse mode it
+// presses the grinder's own button, once to start and once to stop. A stop can be
+// handed to an esp_timer one-shot ahead of time, so it lands when predicted rather
+// than whenever the status task next gets to run.
+// Presses never overlap: one asked for while the button is still held, or within
+// RELAY_RELEASE_GAP_MS of letting go, waits its turn, so the grinder always sees a
+// start and a stop as two presses.
+
+#define SWITCHED_ON 0x01  // switches the status task hasn't printed yet
+#define SWITCHED_OFF 0x02
+
+static std::atomic<bool> grinderRunning(false);
+static std::atomic<int64_t> stoppedAtUs(0); // esp_timer time of the last stop
+static std::atomic<uint8_t> unreportedSwitches(0);
+static esp_timer_handle_t stopTimer = nullptr;
+static esp_timer_handle_t buttonTimer = nullptr; // lets go of a press, then frees the button after the gap
+static std::atomic<int> queuedPresses(0);
+static std::atomic<bool> buttonBusy(false);     // a press, or the gap after it, is under way
+static bool buttonDown = false;                 // only touched by whoever holds buttonBusy
+static std::atomic<int64_t> buttonFreeAtUs(0);  // when the presses asked for so far are done
+
+static void pressButton()
+{
+    queuedPresses--;
+    buttonDown = true;
+    digitalWrite(GRINDER_ACTIVE_PIN, 1);
+    esp_timer_start_once(buttonTimer, RELAY_PRESS_MS * 1000);
+}
+
+static void onButtonTimer(void *arg)
+{
+    if (buttonDown) {
+        buttonDown = false;
+        digitalWrite(GRINDER_ACTIVE_PIN, 0);
+        esp_timer_start_once(buttonTimer, RELAY_RELEASE_GAP_MS * 1000);
+        return;
+    }
+    if (queuedPresses > 0) {
+        pressButton();
+        return;
+    }
+    buttonBusy = false;
+    // A press asked for between the check above and here found the button still busy
+    if (queuedPresses > 0 && !buttonBusy.exchange(true)) {
+        pressButton();
+    }
+}
+
+static void onStopTimer(void *arg)
+{
+    stopGrinder();
+}
+
+// Closes or opens the motor relay, or presses the button without holding up the caller.
+// Returns when the grinder sees it: right away, or once the presses before it are done.
+// Runs in the stop timer's task too, so it leaves the printing to reportGrinderSwitches.
+static int64_t switchGrinder(bool on)
+{
+    int64_t nowUs = esp_timer_get_time();
+    unreportedSwitches.fetch_or(on ? SWITCHED_ON : SWITCHED_OFF);
+    if (grindMode) {
+        digitalWrite(GRINDER_ACTIVE_PIN, on);
+        return nowUs;
+    }
+    int64_t pressAtUs = std::max(nowUs, buttonFreeAtUs.load());
+    buttonFreeAtUs = pressAtUs + (RELAY_PRESS_MS + RELAY_RELEASE_GAP_MS) * 1000;
+    queuedPresses++;
+    if (!buttonBusy.exchange(true)) {
+        pressButton();
+    }
+    return pressAtUs;
+}
+
+// Opens the relay and drops anything still scheduled; safe to call again
+void setupRelay()
+{
+    if (stopTimer == nullptr) {
+        esp_timer_create_args_t args = {};
+        args.callback = onStopTimer;
+        args.name = "grinderStop";
+        esp_timer_create(&args, &stopTimer);
+        args.callback = onButtonTimer;
+        args.name = "grinderButton";
+        esp_timer_create(&args, &buttonTimer);
+    }
+    esp_timer_stop(stopTimer);
+    esp_timer_stop(buttonTimer);
+    grinderRunning = false;
+    queuedPresses = 0;
+    buttonBusy = false;
+    buttonDown = false;
+    buttonFreeAtUs = 0;
+    unreportedSwitches = 0;
+    pinMode(GRINDER_ACTIVE_PIN, OUTPUT);
+    digitalWrite(GRINDER_ACTIVE_PIN, 0);
+}
+
+void startGrinder()
+{
+    if (scaleMode || grinderRunning.exchange(true)) {
+        return;
+    }
+    switchGrinder(true);
+}
+
+// Whoever gets here first, the status task or the stop timer, does the switching
+void stopGrinder()
+{
+    esp_timer_stop(stopTimer);
+    if (!grinderRunning.exchange(false)) {
+        return;
+    }
+    stoppedAtUs = switchGrinder(false);
+}
+
+// Arms the one-shot to stop the grinder at atUs (esp_timer time), or moves it there.
+// Whatever has passed since is taken off, a time already past stops it right away.
+void scheduleGrinderStop(int64_t atUs)
+{
+    if (!grinderRunning) {
+        return;
+    }
+    int64_t inUs = atUs - esp_timer_get_time();
+    if (inUs <= 0) {
+        stopGrinder();
+        return;
+    }
+    esp_timer_stop(stopTimer);
+    esp_timer_start_once(stopTimer, (uint64_t)inUs);
+}
+
+void cancelGrinderStop()
+{
+    esp_timer_stop(stopTimer);
+}
+
+bool isGrinderRunning()
+{
+    return grinderRunning;
+}
+
+int64_t grinderStoppedAtUs()
+{
+    return stoppedAtUs;
+}
+
+// Prints the switches made since the last call; the status task calls it, never the stop timer
+void reportGrinderSwitches()
+{
+    uint8_t switches = unreportedSwitches.exchange(0);
+    if (switches & SWITCHED_ON) {
+        Serial.println(grindMode ? "Grinder toggled: ON" : "Grinder ON (Impulse Mode)");
+    }
+    if (switches & SWITCHED_OFF) {
+        Serial.println(grindMode ? "Grinder toggled: OFF" : "Grinder OFF (Impulse Mode)");
+    }
+}
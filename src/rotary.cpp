@@ -5,6 +5,7 @@
 #include "rotary.hpp"
 #include "display.hpp"
 #include "scale.hpp"
+#include "settings.hpp"
 
 // Rotary encoder for user input
 AiEsp32RotaryEncoder rotaryEncoder = AiEsp32RotaryEncoder(
@@ -28,7 +29,7 @@ static void handleSingleClickTask(void *param) {
     if (*pendingFlag && scaleStatus == STATUS_EMPTY) {
         *pendingFlag = false;
         Serial.println("Single click detected. Opening menu...");
-        scaleStatus = STATUS_IN_MENU;
+        setScaleStatus(STATUS_IN_MENU);
         currentMenuItem = 0;
         rotaryEncoder.setAcceleration(0);
         Serial.println("Entering Menu...");
@@ -41,13 +42,13 @@ void exitToMenu()
 {
     if (scaleStatus == STATUS_IN_SUBMENU || scaleStatus == STATUS_INFO_MENU)
     {
-        scaleStatus = STATUS_IN_MENU;
+        setScaleStatus(STATUS_IN_MENU);
         currentSetting = -1;
         Serial.println("Exiting to main menu");
     }
     else if (scaleStatus == STATUS_IN_MENU)
     {
-        scaleStatus = STATUS_EMPTY;
+        setScaleStatus(STATUS_EMPTY);
         Serial.println("Exiting to empty state");
     }
 }
@@ -92,7 +93,7 @@ void rotary_onButtonClick()
 
         // Use the display method from display.cpp
         showDebugModeStatus(debugMode);
-        menuItemsCount = debugMode ? 10 : 9;
+        menuItemsCount = debugMode ? 11 : 10;
         clickCount = 0; // Reset the click count
         return;         // Exit early to prevent other actions
     }
@@ -130,7 +131,7 @@ void rotary_onButtonClick()
     if (scaleStatus == STATUS_EMPTY)
     {
         // Enter the menu when the scale is empty
-        scaleStatus = STATUS_IN_MENU;
+        setScaleStatus(STATUS_IN_MENU);
         currentMenuItem = 0;
         rotaryEncoder.setAcceleration(0);
         Serial.println("Entering Menu...");
@@ -141,17 +142,15 @@ void rotary_onButtonClick()
         switch (currentMenuItem)
         {
         case 0: // Cup Weight Menu
-            scaleStatus = STATUS_IN_SUBMENU;
+            setScaleStatus(STATUS_IN_SUBMENU);
             currentSetting = 0;
             tareScale(); // Tare the scale
-            delay(500);  // Wait for stabilization
+            waitForTare(TARE_TIMEOUT_MS);
 
             if (scaleWeight > 0)
             {
                 setCupWeight = scaleWeight;
-                preferences.begin("scale", false);
-                preferences.putDouble("cup", setCupWeight);
-                preferences.end();
+                settingChanged(SETTING_CUP_WEIGHT);
 
                 Serial.println("Cup weight set successfully");
             }
@@ -163,54 +162,59 @@ void rotary_onButtonClick()
 
         case 1: // Calibration Menu
         {
-            scaleStatus = STATUS_IN_SUBMENU;
+            setScaleStatus(STATUS_IN_SUBMENU);
             currentSetting = 1;
             tareScale();
             Serial.println("Calibration Menu");
             break;
         }
         case 2: // Offset Menu
-            scaleStatus = STATUS_IN_SUBMENU;
+            setScaleStatus(STATUS_IN_SUBMENU);
             currentSetting = 2;
             Serial.println("Offset Menu");
             break;
         case 3: // Scale Mode Menu
-            scaleStatus = STATUS_IN_SUBMENU;
+            setScaleStatus(STATUS_IN_SUBMENU);
             currentSetting = 3;
             Serial.println("Scale Mode Menu");
             break;
         case 4: // Grinding Mode Menu
-            scaleStatus = STATUS_IN_SUBMENU;
+            setScaleStatus(STATUS_IN_SUBMENU);
             currentSetting = 4;
             Serial.println("Grind Mode Menu");
             break;
         case 5: // Info Menu
-            scaleStatus = STATUS_IN_SUBMENU;
+            setScaleStatus(STATUS_IN_SUBMENU);
             currentSetting = 5;
             Serial.println("Info Menu");
             break;
         case 6: // Sleep Timer Menu
-            scaleStatus = STATUS_IN_SUBMENU;
+            setScaleStatus(STATUS_IN_SUBMENU);
             currentSetting = 8;
             Serial.println("Sleep Timer Menu");
             break;
-        case 7:                                 // Exit
+        case 7: // Top Up Menu
+            setScaleStatus(STATUS_IN_SUBMENU);
+            currentSetting = 10;
+            Serial.println("Top Up Menu");
+            break;
+        case 8:                                 // Exit
             menuPending = false;                // Reset pending flag
-            scaleStatus = STATUS_EMPTY;         // Reset to the empty state
+            setScaleStatus(STATUS_EMPTY);         // Reset to the empty state
             currentMenuItem = 0;                // Reset menu index
             rotaryEncoder.setAcceleration(100); // Restore encoder acceleration
             Serial.println("Exited Menu to main screen");
             delay(200); // Debounce to prevent immediate re-trigger
             break;
-        case 8: // Reset Menu
-            scaleStatus = STATUS_IN_SUBMENU;
+        case 9: // Reset Menu
+            setScaleStatus(STATUS_IN_SUBMENU);
             currentSetting = 6;
             Serial.println("Reset Menu");
             break;
-        case 9: // Debug Menu
+        case 10: // Debug Menu
             if (debugMode)
             {
-                scaleStatus = STATUS_IN_SUBMENU;
+                setScaleStatus(STATUS_IN_SUBMENU);
                 currentSetting = 9; // Identifier for Debug Menu
                 Serial.println("Entering Debug Menu");
             }
@@ -224,14 +228,11 @@ void rotary_onButtonClick()
         {
         case 0: // Cup Weight Menu
         {
-            if (scaleWeight > 5)
+            if (scaleWeight > 5000)
             { // Ensure cup weight is valid
                 setCupWeight = scaleWeight;
-                Serial.println(setCupWeight);
-
-                preferences.begin("scale", false);
-                preferences.putDouble("cup", setCupWeight);
-                preferences.end();
+                Serial.println(mgToGrams(setCupWeight));
+                settingChanged(SETTING_CUP_WEIGHT);
 
                 displayLock = true;
                 showCupWeightSetScreen(setCupWeight); // Show confirmation
@@ -242,10 +243,8 @@ void rotary_onButtonClick()
             else
             {
                 Serial.println("Error: Invalid cup weight detected. Setting default value.");
-                setCupWeight = 10.0; // Assign a reasonable default value
-                preferences.begin("scale", false);
-                preferences.putDouble("cup", setCupWeight);
-                preferences.end();
+                setCupWeight = 10000; // Assign a reasonable default value
+                settingChanged(SETTING_CUP_WEIGHT);
                 Serial.println("Failsafe: Exiting cup weight menu due to zero weight");
                 exitToMenu();
             }
@@ -253,39 +252,31 @@ void rotary_onButtonClick()
         }
         case 1: // Calibration Menu
         {
-            double newCalibrationValue = preferences.getDouble("calibration", 1.0) * (scaleWeight / 100);
-            preferences.begin("scale", false);
-            preferences.putDouble("calibration", newCalibrationValue);
-            preferences.end();
-            loadcell.set_scale(newCalibrationValue);
-            scaleStatus = STATUS_IN_MENU;
+            double newCalibrationValue = loadcellCountsPerGram * (mgToGrams(scaleWeight) / 100);
+            setScaleFactor(newCalibrationValue);
+            saveSettings();
+            setScaleStatus(STATUS_IN_MENU);
             currentSetting = -1;
             break;
         }
         case 2: // Offset Menu
         {
-            preferences.begin("scale", false);
-            preferences.putDouble("offset", offset);
-            preferences.end();
-            scaleStatus = STATUS_IN_MENU;
+            settingChanged(SETTING_OFFSET);
+            setScaleStatus(STATUS_IN_MENU);
             currentSetting = -1;
             break;
         }
         case 3: // Scale Mode Menu
         {
-            preferences.begin("scale", false);
-            preferences.putBool("scaleMode", scaleMode);
-            preferences.end();
-            scaleStatus = STATUS_IN_MENU;
+            settingChanged(SETTING_SCALE_MODE);
+            setScaleStatus(STATUS_IN_MENU);
             currentSetting = -1;
             break;
         }
         case 4: // Grinding Mode Menu
         {
-            preferences.begin("scale", false);
-            preferences.putBool("grindMode", grindMode);
-            preferences.end();
-            scaleStatus = STATUS_IN_MENU;
+            settingChanged(SETTING_GRIND_MODE);
+            setScaleStatus(STATUS_IN_MENU);
             currentSetting = -1;
             break;
         }
@@ -302,77 +293,53 @@ void rotary_onButtonClick()
         {
             if (greset)
             {
-                preferences.begin("scale", false);
-                preferences.putDouble("calibration", (double)LOADCELL_SCALE_FACTOR);
-                setWeight = (double)COFFEE_DOSE_WEIGHT;
-                preferences.putDouble("setWeight", (double)COFFEE_DOSE_WEIGHT);
-                offset = (double)COFFEE_DOSE_OFFSET;
-                preferences.putDouble("offset", (double)COFFEE_DOSE_OFFSET);
-                setCupWeight = (double)CUP_WEIGHT;
-                preferences.putDouble("cup", (double)CUP_WEIGHT);
+                setWeight = COFFEE_DOSE_WEIGHT;
+                offset = COFFEE_DOSE_OFFSET;
+                offsetTable.clear();
+                stopDelayMs = STOP_DELAY_MS;
+                topUpMode = false;
+                pulseRateMgPerS = TOPUP_PULSE_RATE;
+                setCupWeight = CUP_WEIGHT;
                 scaleMode = false;
-                preferences.putBool("scaleMode", false);
                 grindMode = false;
-                preferences.putBool("grindMode", false);
-                preferences.putUInt("shotCount", 0);
-                loadcell.set_scale((double)LOADCELL_SCALE_FACTOR);
-                preferences.end();
+                shotCount = 0;
+                setScaleFactor((double)LOADCELL_SCALE_FACTOR);
+                saveSettings(); // All of it in one write
             }
-            scaleStatus = STATUS_IN_MENU;
+            setScaleStatus(STATUS_IN_MENU);
             currentSetting = -1;
             break;
         }
         case 8: // Grind Trigger Menu
         {
             useButtonToGrind = !useButtonToGrind;
-            preferences.begin("scale", false);
-            preferences.putBool("grindTrigger", useButtonToGrind);
-            preferences.end();
+            settingChanged(SETTING_GRIND_TRIGGER);
             Serial.print("Grind Trigger Mode changed to: ");
             Serial.println(useButtonToGrind ? "Button" : "Cup");
             exitToMenu();
             break;
         }
-        case 9: // Debug Menu
+        case 10: // Top Up Menu
         {
-            int newValue = rotaryEncoder.readEncoder();
-            int debugOption = (newValue - encoderValue) % 3;               // Cycle through options
-            debugOption = debugOption < 0 ? 3 + debugOption : debugOption; // Wrap negative values
-            encoderValue = newValue;
-
-            if (rotaryEncoder.isEncoderButtonClicked())
-            {
-                switch (debugOption)
-                {
-                case 0: // Simulate Grinding
-                    Serial.println("Simulating Grinding...");
-                    scaleStatus = STATUS_GRINDING_IN_PROGRESS;
-                    startedGrindingAt = millis();
-                    setWeight = 20.0;     // Example weight
-                    cupWeightEmpty = 5.0; // Example cup weight
-                    break;
-
-                case 1: // Show Weight History
-                    Serial.println("Displaying Weight History...");
-                    // Add logic to display weight history
-                    break;
-
-                case 2: // Reset Shot Count
-                    Serial.println("Resetting Shot Count...");
-                    shotCount = 0;
-                    preferences.begin("scale", false);
-                    preferences.putUInt("shotCount", shotCount);
-                    preferences.end();
-                    break;
-                }
-            }
-            exitToMenu();
+            settingChanged(SETTING_TOP_UP);
+            setScaleStatus(STATUS_IN_MENU);
+            currentSetting = -1;
             break;
         }
         }
     }
 }
 
+// Task to poll the rotary encoder, kept off the grind control path
+void updateRotary(void *parameter)
+{
+    for (;;)
+    {
+        rotary_loop();
+        delay(ROTARY_POLL_MS);
+    }
+}
+
 // Handles rotary encoder input for menu navigation and adjustments
 void rotary_loop()
 {
@@ -401,11 +368,9 @@ void rotary_loop()
                 Serial.println("Grind weight cannot be less than 0. Reset to 0.");
             }
             int newValue = rotaryEncoder.readEncoder();
-            setWeight += ((float)newValue - (float)encoderValue) / 10 * encoderDir;
+            setWeight += (newValue - encoderValue) * (MG_PER_GRAM / 10) * encoderDir;
             encoderValue = newValue;
-            preferences.begin("scale", false);
-            preferences.putDouble("setWeight", setWeight);
-            preferences.end();
+            settingChanged(SETTING_SET_WEIGHT);
             break;
         }
         case STATUS_IN_MENU:
@@ -423,7 +388,7 @@ void rotary_loop()
             int newValue = rotaryEncoder.readEncoder();
             if (currentSetting == 2)
             { // Offset menu
-                offset += ((float)newValue - (float)encoderValue) * encoderDir / 100;
+                offset += (newValue - encoderValue) * encoderDir * (MG_PER_GRAM / 100);
                 encoderValue = newValue;
                 if (abs(offset) >= setWeight)
                 {
@@ -442,6 +407,10 @@ void rotary_loop()
             {
                 greset = !greset;
             }
+            else if (currentSetting == 10)
+            {
+                topUpMode = !topUpMode;
+            }
             else if (currentSetting == 8)
             {                                                  // Sleep Timer menu
                 sleepTime += (newValue - encoderValue) * 1000; // Adjust by seconds
@@ -454,11 +423,7 @@ void rotary_loop()
                     sleepTime = 600000; // Maximum sleep time: 10 minutes
                 }
                 encoderValue = newValue;
-
-                // Save the updated sleep time to preferences
-                preferences.begin("scale", false);
-                preferences.putInt("sleepTime", sleepTime);
-                preferences.end();
+                settingChanged(SETTING_SLEEP_TIME);
             }
             else if (scaleStatus == STATUS_IN_SUBMENU && currentSetting == 9) // Debug Menu
             {
@@ -473,7 +438,7 @@ void rotary_loop()
         case STATUS_GRINDING_FAILED:
         {
             Serial.println("Exiting Grinding Failed state to Main Menu...");
-            scaleStatus = STATUS_IN_MENU;
+            setScaleStatus(STATUS_IN_MENU);
             currentMenuItem = 0; // Reset to the main menu
             return; // Exit early to avoid further processing
         }
@@ -1,256 +1,1010 @@
+#include <atomic>
+#include <esp_timer.h>
 #include "config.hpp"
 #include "rotary.hpp"
 #include "scale.hpp"
 #include "display.hpp"
+#include "recorder.hpp"
+#include "relay.hpp"
+#include "settings.hpp"
+#include "shotlog.hpp"
 
 // Variables for scale functionality
-double scaleWeight = 0;       // Current weight measured by the scale
-double setWeight = 0;         // Target weight set by the user
-double setCupWeight = 0;      // Weight of the cup set by the user
-double offset = 0;            // Offset for stopping grinding prior to reaching set weight
+int32_t scaleWeight = 0;      // Current weight measured by the scale (mg)
+int32_t setWeight = 0;        // Target weight set by the user (mg)
+int32_t setCupWeight = 0;     // Weight of the cup set by the user (mg)
+int32_t offset = 0;           // Offset for stopping grinding prior to reaching set weight (mg)
 bool scaleMode = false;       // Indicates if the scale is used in timer mode
 bool grindMode = false;       // Grinder mode: impulse (false) or continuous (true)
-bool grinderActive = false;   // Grinder state (on/off)
+bool topUpMode = false;       // Stop short of the dose and pulse the rest in
 unsigned int shotCount;
 
-// Buffer for storing recent weight history
-MathBuffer<double, 100> weightHistory;
+// Buffer for storing recent weight history (mg), safe to read from any task
+ConcurrentBuffer<WeightHistory> weightHistory;
+
+// Load cell calibration as Q16 milligrams per raw HX711 count
+int32_t mgPerCountQ16 = 0;
+double loadcellCountsPerGram = LOADCELL_SCALE_FACTOR; // The same as set from the menu, for the stored settings
+
+// Raw HX711 counts that read as zero weight, moved by tares and zero tracking
+int32_t scaleZeroCounts = 0;
+static int64_t zeroTrackingQ8 = 0; // scaleZeroCounts with 8 fractional bits, so slow drift adds up
+volatile bool tarePending = false;  // A tare was asked for and waits for steady readings
+volatile bool grindSimulated = false; // The debug menu shows the grinding screen, no grind behind it
+static MathBuffer<int32_t, TARE_MEASURES> tareWindow; // Latest raw readings, averaged for a tare
+
+// Zero drift against the C3's internal temperature sensor, learned while the scale sits empty
+float driftCountsPerDegree = 0;       // Learned coefficient, raw counts per degree C
+float referenceTemperature = NAN; // The correction is relative to the first reading after boot
+static int32_t temperatureCorrectionCounts = 0;
+// Exponentially forgetting least-squares sums of (temperature, idle raw counts), centred on the
+// first idle point so a 24-bit raw value squared doesn't eat the precision
+static struct {
+    double weight, t, raw, tt, traw;
+    double pivotT, pivotRaw;
+} driftFit = {};
+
+// Replaces single-sample spikes by the median of the last few readings
+static HampelFilter<int32_t, HAMPEL_WINDOW> outlierFilter(HAMPEL_MIN_DEVIATION);
+uint32_t rejectedSamples = 0; // Readings the outlier stage replaced, shown in the debug menu
+
+// Finds the motor's vibration line while grinding and notches it out of the readings
+static SpectrumEstimator<VIBRATION_BLOCK> vibrationSpectrum(VIBRATION_MIN_BIN, VIBRATION_PROMINENCE, VIBRATION_MIN_AMPLITUDE);
+static BiquadNotch vibrationNotch;
+uint32_t vibrationFrequencyQ16 = 0; // Notched line in cycles per reading, 0 while the notch is off
+
+// Creep time constant of this load cell, used to predict settled weights
+CreepModel creepModel(CREEP_TIME_CONSTANT_MS);
+
+// Stop offsets learned per dose and grind duration, on top of the menu offset
+StopOffsetTable offsetTable(OFFSET_TABLE_FIRST_DOSE, OFFSET_TABLE_DOSE_STEP, OFFSET_TABLE_FIRST_DURATION, OFFSET_TABLE_DURATION_STEP);
+
+// Set by the DOUT interrupt when the HX711 has a conversion ready
+volatile int64_t loadcellReadyAtUs = 0;
+static int64_t lastReadingAtUs = 0; // When the latest processed reading was taken
+
+// Cycles spent turning the last raw reading into a weight, for profiling
+uint32_t lastSampleCycles = 0;
+uint32_t maxSampleCycles = 0;
 
 // Timing and status variables
 unsigned long scaleLastUpdatedAt = 0;  // Timestamp of the last scale update
 unsigned long lastSignificantWeightChangeAt = 0; // Timestamp of the last significant weight change
 unsigned long lastTareAt = 0; // Timestamp of the last tare operation
 bool scaleReady = false;      // Indicates if the scale is ready to measure
-int scaleStatus = STATUS_EMPTY; // Current status of the scale
-double cupWeightEmpty = 0;    // Measured weight of the empty cup
+bool scaleMoving = false;     // The weight is changing and the filter is following it closely
+std::atomic<int> scaleStatus(STATUS_EMPTY); // Current status of the scale, written by the status task only
+int32_t cupWeightEmpty = 0;   // Measured weight of the empty cup (mg)
 unsigned long startedGrindingAt = 0;  // Timestamp of when grinding started
 unsigned long finishedGrindingAt = 0; // Timestamp of when grinding finished
+uint32_t stopDelayMs = STOP_DELAY_MS; // Flow keeps landing for this long after the relay drops, learned per grinder
+uint32_t pulseRateMgPerS = TOPUP_PULSE_RATE; // What a top-up pulse delivers per second it runs, learned per grinder
+static int32_t flowAtStop = 0;       // Flow rate (mg/s) and weight the last stop was decided on
+static int32_t weightAtStop = 0;
+static uint32_t groundsLandingMs = GROUNDS_LANDING_MS; // How long after the last stop the grounds were expected to land
+static uint32_t grindMsAtStop = 0;   // How long the last shot ground for
+static int32_t offsetAtStop = 0;     // Stop offset the last shot stopped on
+static int32_t shotSettledWeight = 0; // Where the last shot settled, once known
+static int32_t scheduledFlow = 0;    // Flow rate and projected weight the relay timer's stop was armed with
+static int32_t scheduledWeight = 0;
 bool greset = false;          // Flag for reset operation
 bool newOffset = false;       // Indicates if a new offset value is pending
 
 bool useButtonToGrind = DEFAULT_GRIND_TRIGGER_MODE;
 
+// Asks the scale task to zero the scale from the live readings once they are steady.
+// Never blocks, the weight keeps updating until the tare lands.
 void tareScale()
 {
     Serial.println("Taring scale...");
-    loadcell.tare(TARE_MEASURES); // Perform the tare operation
-    delay(500);                   // Allow the load cell to stabilize
-    lastTareAt = millis();        // Update the timestamp
-    scaleWeight = 0;              // Reset the displayed weight
-    Serial.println("Scale tared successfully");
+    tarePending = true;
+}
+
+// For menu flows that need the new zero before they can go on
+bool waitForTare(unsigned long timeoutMs)
+{
+    unsigned long startedAt = millis();
+    while (tarePending && millis() - startedAt < timeoutMs) {
+        delay(10);
+    }
+    return !tarePending;
+}
+
+void setScaleFactor(double countsPerGram)
+{
+    loadcellCountsPerGram = countsPerGram;
+    mgPerCountQ16 = (int32_t)lround((double)MG_PER_GRAM * 65536 / countsPerGram);
+}
+
+// Converts tared HX711 counts to milligrams using integer math only
+static int32_t countsToMg(int32_t counts)
+{
+    return (int32_t)(((int64_t)counts * mgPerCountQ16 + (1 << 15)) >> 16);
+}
+
+// Turns a raw HX711 reading into tared counts. A pending tare is applied as soon as the
+// last TARE_MEASURES readings agree, and while the scale is empty and still the zero
+// slowly follows drift
+int32_t zeroScaleReading(int32_t rawCounts, int64_t timestampUs)
+{
+    rawCounts -= temperatureCorrectionCounts;
+    tareWindow.push(rawCounts, timestampUs);
+
+    if (tarePending) {
+        int32_t spreadMg = countsToMg(tareWindow.maxSince(0) - tareWindow.minSince(0));
+        if (tareWindow.size() == TARE_MEASURES && !scaleMoving && ABS(spreadMg) <= TARE_STABLE_SPREAD) {
+            int32_t newZero = tareWindow.averageSince(0);
+            if (ABS(countsToMg(newZero - scaleZeroCounts)) > ZERO_TRACKING_RANGE) {
+                driftFit = {}; // Idle readings before and after this tare aren't the same empty scale
+            }
+            scaleZeroCounts = newZero;
+            zeroTrackingQ8 = (int64_t)scaleZeroCounts << 8;
+            kalmanFilter.setEstimate(0); // Don't let the filter drift back from the old zero
+            outlierFilter.reset();       // Nor take the first reading at the new zero for a spike
+            scaleWeight = 0;
+            lastTareAt = millis();
+            tarePending = false;
+            Serial.println("Scale tared successfully");
+        }
+    } else if (scaleStatus == STATUS_EMPTY && !scaleMoving &&
+               ABS(countsToMg(rawCounts - scaleZeroCounts)) < ZERO_TRACKING_RANGE) {
+        zeroTrackingQ8 += (((int64_t)rawCounts << 8) - zeroTrackingQ8) >> ZERO_TRACKING_SHIFT;
+        scaleZeroCounts = (int32_t)(zeroTrackingQ8 >> 8);
+    }
+
+    return rawCounts - scaleZeroCounts;
 }
 
-// Task to continuously update the scale readings
+// Moves the zero without the weight jumping, e.g. when the drift correction changes slope
+static void shiftZero(int32_t counts)
+{
+    scaleZeroCounts += counts;
+    zeroTrackingQ8 += (int64_t)counts << 8;
+}
+
+// Takes one reading of the chip temperature. While the scale is empty and still, the idle
+// raw reading is fitted against it to learn how far the zero moves per degree; that slope
+// is then taken off every reading, loaded or not, before it reaches the filter. Only the
+// zero can be learned this way, span drift would need a known weight on the scale.
+void processTemperatureReading(float celsius)
+{
+    if (std::isnan(referenceTemperature)) {
+        referenceTemperature = celsius;
+    }
+
+    bool idle = !tarePending && scaleStatus == STATUS_EMPTY && !scaleMoving &&
+                tareWindow.size() == TARE_MEASURES && scaleWeight == 0;
+    if (idle) {
+        double raw = (double)tareWindow.averageSince(0) + temperatureCorrectionCounts;
+        if (driftFit.weight == 0) {
+            driftFit.pivotT = celsius;
+            driftFit.pivotRaw = raw;
+        }
+        double t = celsius - driftFit.pivotT;
+        double r = raw - driftFit.pivotRaw;
+        driftFit.weight = driftFit.weight * DRIFT_FORGETTING + 1;
+        driftFit.t = driftFit.t * DRIFT_FORGETTING + t;
+        driftFit.raw = driftFit.raw * DRIFT_FORGETTING + r;
+        driftFit.tt = driftFit.tt * DRIFT_FORGETTING + t * t;
+        driftFit.traw = driftFit.traw * DRIFT_FORGETTING + t * r;
+
+        double variance = driftFit.tt / driftFit.weight - (driftFit.t / driftFit.weight) * (driftFit.t / driftFit.weight);
+        if (driftFit.weight >= DRIFT_MIN_SAMPLES && variance >= DRIFT_MIN_SPREAD * DRIFT_MIN_SPREAD) {
+            double slope = (driftFit.weight * driftFit.traw - driftFit.t * driftFit.raw) /
+                           (driftFit.weight * driftFit.tt - driftFit.t * driftFit.t);
+            if (ABS(countsToMg((int32_t)lround(slope))) <= DRIFT_MAX_MG_PER_DEGREE) {
+                // The correction for the current temperature changes with the slope, keep the weight where it is
+                shiftZero(-(int32_t)lround((slope - driftCountsPerDegree) * (celsius - referenceTemperature)));
+                driftCountsPerDegree = (float)slope;
+                settingLearned(); // Written with the next shot checkpoint
+            }
+        }
+    }
+
+    temperatureCorrectionCounts = (int32_t)lround(driftCountsPerDegree * (celsius - referenceTemperature));
+}
+
+// Puts the zero and the drift correction back to where a recording found them, with no
+// readings behind them yet, so a replay weighs its raw counts the way the device did
+void restoreZeroState(int32_t zeroCounts, float countsPerDegree, float referenceCelsius, float celsius)
+{
+    scaleZeroCounts = zeroCounts;
+    zeroTrackingQ8 = (int64_t)zeroCounts << 8;
+    driftCountsPerDegree = countsPerDegree;
+    referenceTemperature = referenceCelsius;
+    temperatureCorrectionCounts = std::isnan(referenceCelsius) ? 0 : (int32_t)lround(countsPerDegree * (celsius - referenceCelsius));
+    tareWindow = MathBuffer<int32_t, TARE_MEASURES>();
+    driftFit = {};
+}
+
+// While the grinder runs, tracks its strongest vibration line and notches it out.
+// The notch stays on the last line found until grinding stops.
+static int32_t removeVibration(int32_t measurementMg)
+{
+    if (scaleStatus != STATUS_GRINDING_IN_PROGRESS) {
+        vibrationSpectrum.reset();
+        vibrationNotch.disable();
+        vibrationFrequencyQ16 = 0;
+        return measurementMg;
+    }
+
+    if (vibrationSpectrum.push(measurementMg) && vibrationSpectrum.hasPeak()) {
+        vibrationFrequencyQ16 = vibrationSpectrum.peakFrequencyQ16();
+        vibrationNotch.tune(vibrationFrequencyQ16, NOTCH_POLE_RADIUS);
+        if (debugMode) {
+            Serial.printf("Vibration: %ld mg at %u/1000 of the sample rate\n",
+                          (long)vibrationSpectrum.peakAmplitude(), (unsigned)(vibrationFrequencyQ16 * 1000 >> 16));
+        }
+    }
+    return vibrationNotch.filter(measurementMg);
+}
+
+// Raises the filter gain while the weight moves or the grinder runs, so it follows
+// within a sample or two, and lets it smooth again once the weight rests.
+// Motion is judged on motionMg: the measurement, or the reading the outlier stage
+// replaced by it, so the first reading of a real step still counts towards confirming it.
+static int32_t filterReading(int32_t measurementMg, int32_t motionMg)
+{
+    static int motionSamples = 0; // signed run of readings off the estimate, by side
+    static int quietSamples = FILTER_SETTLE_SAMPLES;
+
+    int32_t innovation = motionMg - kalmanFilter.getEstimate();
+    if (innovation > FILTER_MOTION_THRESHOLD) {
+        motionSamples = motionSamples > 0 ? motionSamples + 1 : 1;
+    } else if (innovation < -FILTER_MOTION_THRESHOLD) {
+        motionSamples = motionSamples < 0 ? motionSamples - 1 : -1;
+    } else {
+        motionSamples = 0;
+    }
+
+    if (ABS(motionSamples) >= FILTER_MOTION_SAMPLES) {
+        quietSamples = 0;
+    } else if (quietSamples < FILTER_SETTLE_SAMPLES) {
+        quietSamples++;
+    }
+    scaleMoving = quietSamples < FILTER_SETTLE_SAMPLES;
+
+    if (scaleMoving) {
+        kalmanFilter.setMinimumEstimateError(FILTER_MOTION_ESTIMATE_ERROR);
+    } else if (scaleStatus == STATUS_GRINDING_IN_PROGRESS) {
+        // With the motor's vibration notched out there is less left to smooth
+        kalmanFilter.setMinimumEstimateError(vibrationNotch.enabled() ? FILTER_NOTCHED_ESTIMATE_ERROR : FILTER_GRINDING_ESTIMATE_ERROR);
+    } else {
+        kalmanFilter.setMinimumEstimateError(0);
+    }
+    return kalmanFilter.updateEstimate(measurementMg);
+}
+
+// Runs one tared HX711 reading, taken at timestampUs, through the filter and into the weight history
+void processScaleReading(int32_t counts, int64_t timestampUs) {
+    uint32_t startCycles = ESP.getCycleCount();
+    int32_t readingMg = countsToMg(counts);
+    int32_t measurementMg = removeVibration(outlierFilter.filter(readingMg));
+    scaleWeight = filterReading(measurementMg, outlierFilter.lastRejected() ? readingMg : measurementMg);
+    rejectedSamples = outlierFilter.rejectedCount();
+    // Serial.printf("Scale reading: %ld mg\n", (long)scaleWeight);
+    if (ABS(scaleWeight) < 3000)
+    {
+        scaleWeight = 0;
+    }
+    scaleLastUpdatedAt = millis();
+    lastReadingAtUs = timestampUs;
+    weightHistory.push(scaleWeight, timestampUs);
+    lastSampleCycles = ESP.getCycleCount() - startCycles;
+    if (lastSampleCycles > maxSampleCycles) {
+        maxSampleCycles = lastSampleCycles;
+        if (debugMode) {
+            Serial.printf("Sample path: %u cycles (new max)\n", (unsigned)maxSampleCycles);
+        }
+    }
+    scaleReady = true;
+}
+
+// DOUT falls as soon as a conversion is ready: note when, and wake the scale task
+static void IRAM_ATTR onLoadcellReady() {
+    loadcellReadyAtUs = esp_timer_get_time();
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    if (ScaleTask != nullptr) {
+        vTaskNotifyGiveFromISR(ScaleTask, &higherPriorityTaskWoken);
+    }
+    if (higherPriorityTaskWoken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+// Task to continuously update the scale readings, one per HX711 conversion
 void updateScale(void *parameter) {
-    float lastEstimate;
+    unsigned long temperatureSampledAt = 0;
     for (;;) {
-        if (lastTareAt == 0) {
-            Serial.println("retaring scale");
-            Serial.println("current offset");
-            Serial.println(offset);
-            tareScale();
-        }
-        if (loadcell.wait_ready_timeout(300)) {
-            lastEstimate = kalmanFilter.updateEstimate(loadcell.get_units(5));
-            scaleWeight = lastEstimate;
-            // Serial.printf("Scale reading: %.2f g\n", scaleWeight);
-            if (ABS(scaleWeight) < 3)
-            {
-                scaleWeight = 0;
+        // Sleeps until the DOUT interrupt. The timeout covers a conversion that was already
+        // waiting before we got here, and a missing HX711.
+        bool notified = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOADCELL_TIMEOUT_MS)) > 0;
+        if (!loadcell.is_ready()) {
+            // Edges from clocking out the previous sample also notify us, wait for the real one
+            if (millis() - scaleLastUpdatedAt > LOADCELL_TIMEOUT_MS) {
+                Serial.println("HX711 not found.");
+                scaleReady = false;
             }
-            scaleLastUpdatedAt = millis();
-            weightHistory.push(scaleWeight);
-            scaleReady = true;
-        } else {
-            Serial.println("HX711 not found.");
-            scaleReady = false;
+            continue;
+        }
+        int64_t readyAtUs = notified ? loadcellReadyAtUs : esp_timer_get_time();
+        if (millis() - temperatureSampledAt >= TEMPERATURE_SAMPLE_MS) {
+            temperatureSampledAt = millis();
+            float celsius = temperatureRead();
+            processTemperatureReading(celsius);
+            recordTemperature(celsius, readyAtUs); // Stamped with the reading it comes before
         }
+        int32_t rawCounts = loadcell.read();
+        recordRawSample(rawCounts, readyAtUs); // Before the zero, so a replay goes through the tare and drift paths too
+        int32_t counts = zeroScaleReading(rawCounts, readyAtUs);
+        processScaleReading(counts, readyAtUs);
+        // Hand the reading to the grind state machine right away
+        if (ScaleStatusTask != nullptr) {
+            xTaskNotify(ScaleStatusTask, EVENT_SAMPLE, eSetBits);
+        }
+    }
+}
+
+// Where the weight will settle, predicted from the creep seen in the samples since fromMs.
+// Falls back to their plain average while the prediction can't be trusted yet.
+static int32_t predictSettledWeight(int64_t fromMs)
+{
+    struct Prediction { bool valid; int32_t settled; int32_t average; };
+    Prediction prediction = weightHistory.read([fromMs](const WeightHistory &history) {
+        MathBuffer<int32_t, WeightHistory::capacity>::Window window = history.raw().since(fromMs);
+        Prediction result = {false, 0, history.raw().averageSince(fromMs)};
+        result.valid = creepModel.predictSettled(window.begin(), window.end(), fromMs, result.settled);
+        return result;
+    });
+    if (!prediction.valid || ABS(prediction.settled - prediction.average) > CREEP_MAX_CORRECTION) {
+        return prediction.average;
+    }
+    return prediction.settled;
+}
+
+// Rate the weight has been rising at over the samples since fromMs, in mg/s (least-squares slope)
+static int32_t flowRateSince(int64_t fromMs)
+{
+    return weightHistory.read([fromMs](const WeightHistory &history) {
+        MathBuffer<int32_t, WeightHistory::capacity>::Window window = history.raw().since(fromMs);
+        if (window.size() < 3) {
+            return (int32_t)0;
+        }
+        // Relative to the first sample so the sums stay well inside 64 bits
+        int64_t firstMs = window.begin().timestamp();
+        int32_t firstWeight = *window.begin();
+        int64_t n = 0, sumT = 0, sumW = 0, sumTT = 0, sumTW = 0;
+        for (auto it = window.begin(); it != window.end(); ++it) {
+            int64_t t = it.timestamp() - firstMs;
+            int64_t w = *it - firstWeight;
+            n++;
+            sumT += t;
+            sumW += w;
+            sumTT += t * t;
+            sumTW += t * w;
+        }
+        int64_t denominator = n * sumTT - sumT * sumT;
+        if (denominator <= 0) {
+            return (int32_t)0;
+        }
+        return (int32_t)((n * sumTW - sumT * sumW) * 1000 / denominator);
+    });
+}
+
+// Dose the grind itself stops for: the set weight, or short of it when the rest is pulsed in
+int32_t grindTargetMg()
+{
+    return topUpMode && !scaleMode ? setWeight - TOPUP_SHORTFALL : setWeight;
+}
+
+// Offset to stop a dose of doseMg at, after grinding for grindMs: the menu offset plus what was learned there
+int32_t stopOffsetFor(int32_t doseMg, uint32_t grindMs)
+{
+    return offset + offsetTable.lookup(doseMg, grindMs);
+}
+
+// Mean of the samples taken in [fromMs, toMs)
+static int32_t averageBetween(int64_t fromMs, int64_t toMs)
+{
+    return weightHistory.read([fromMs, toMs](const WeightHistory &history) {
+        MathBuffer<int32_t, WeightHistory::capacity>::Window window = history.raw().since(fromMs);
+        int64_t sum = 0;
+        int32_t count = 0;
+        for (auto it = window.begin(); it != window.end() && it.timestamp() < toMs; ++it) {
+            sum += *it;
+            count++;
+        }
+        return count > 0 ? (int32_t)(sum / count) : 0;
+    });
+}
+
+// Bookkeeping once the grinder has been stopped at the target at atMs
+static void grindStopped(unsigned long atMs, int32_t flow, int32_t weight)
+{
+    finishedGrindingAt = atMs;
+    flowAtStop = flow;
+    weightAtStop = weight;
+    grindMsAtStop = finishedGrindingAt - startedGrindingAt;
+    offsetAtStop = stopOffsetFor(grindTargetMg(), grindMsAtStop);
+    groundsLandingMs = GROUNDS_LANDING_MS + stopDelayMs;
+}
+
+// Learns the stop delay and the stop offset for doseMg from where the last stop settled
+static void learnFromStop(int32_t settledWeight, int32_t doseMg)
+{
+    if (settledWeight == doseMg + cupWeightEmpty) {
+        return;
+    }
+    // What landed after the stop, over the flow at the stop, is how long it kept coming
+    uint32_t previousDelayMs = stopDelayMs;
+    int32_t landedAfterStop = settledWeight - weightAtStop;
+    if (flowAtStop >= FLOW_MIN_TO_LEARN && landedAfterStop > 0) {
+        int64_t observedMs = (int64_t)landedAfterStop * 1000 / flowAtStop;
+        if (observedMs > STOP_DELAY_MAX_MS) {
+            observedMs = STOP_DELAY_MAX_MS;
+        }
+        stopDelayMs = (uint32_t)(stopDelayMs + (observedMs - (int64_t)stopDelayMs) / 2);
+    }
+    // The offset keeps what the projection doesn't explain; what the new delay
+    // adds at this flow is already covered by it
+    int32_t correction = doseMg + cupWeightEmpty - settledWeight
+                         + (int32_t)((int64_t)flowAtStop * ((int64_t)stopDelayMs - previousDelayMs) / 1000);
+    // Learned for this dose and grind time only, so other doses keep theirs
+    if (ABS(stopOffsetFor(doseMg, grindMsAtStop) + correction) < doseMg) {
+        offsetTable.learn(doseMg, grindMsAtStop, correction);
+    }
+    countShot(); // Saves what was learned along with every few shots
+    newOffset = false;
+}
+
+// Grind state machine
+//
+// Each step collects the events that came in, then takes the first transition below
+// that leaves the current status on one of them and whose guard holds: its action
+// runs and the status moves on. Rows are checked in order, so earlier rows win.
+// When none fires, the status's activity runs instead. The step is the only writer of
+// the status: the menus ask for theirs through setScaleStatus, and the first row below
+// applies it as EVENT_MENU, so a step deciding something else can't lose it.
+
+struct StatusTransition {
+    int from;
+    uint8_t events;   // any of these can take it
+    bool (*guard)();  // nullptr: always
+    void (*action)(); // nullptr: nothing to do on the way
+    int to;
+};
+
+#define STATUS_ANY -1       // from: whatever the status is
+#define STATUS_REQUESTED -2 // to: the status a menu asked for
+#define STATUS_NONE -3      // no menu request waiting
+
+struct StatusBehaviour {
+    int status;
+    void (*enter)();                 // on arriving from another status
+    bool (*activity)(uint8_t events); // while no transition fires, true to be stepped again
+};
+
+static TransitionStats transitionTable[STATUS_COUNT][STATUS_COUNT];
+
+// The status a menu asked for, until the next step applies it
+static std::atomic<int> requestedStatus(STATUS_NONE);
+static int menuStatus = STATUS_NONE; // the request the step took
+static std::atomic<bool> transitionStatsReset(false);
+
+// Button debounce, looked at while the scale is empty
+static bool grinderButtonPressed = false;
+static unsigned long grinderButtonPressedAt = 0;
+
+// Where the running grind is headed, projected on each reading
+static struct {
+    int32_t flow;      // mg/s, 0 in scale mode
+    int32_t weightNow;
+    int32_t inFlight;  // what lands after a stop right now
+    int32_t target;
+} projection;
+
+// Top-up pulses of the current shot
+static int topUpPulses = 0;
+static bool pulseRunning = false;
+static uint32_t pulseMs = 0;
+static int32_t weightBeforePulse = 0;
+static bool toppedUp = false;
+
+static unsigned long grindingFinishedAt = 0; // When the status last became finished
+static bool creepLearned = false;
+
+static void recordTransition(int from, int to, uint8_t event, int64_t eventAtUs)
+{
+    TransitionStats &stats = transitionTable[from][to];
+    uint32_t latencyUs = (uint32_t)(esp_timer_get_time() - eventAtUs);
+    stats.count++;
+    stats.lastAtMs = millis();
+    stats.lastEvent = event;
+    stats.lastLatencyUs = latencyUs;
+    if (latencyUs > stats.worstLatencyUs) {
+        stats.worstLatencyUs = latencyUs;
     }
 }
 
-// Toggles the grinder on or off based on mode
-void grinderToggle() {
+// Events that start a grind, looked for while the scale is empty
+static uint8_t pollStartEvents()
+{
+    if (scaleStatus != STATUS_EMPTY) {
+        return 0;
+    }
+    uint8_t events = 0;
+
+    // Only allow button trigger if grindMode == true
+    if (grindMode && digitalRead(GRIND_BUTTON_PIN) == LOW && !grinderButtonPressed) {
+        grinderButtonPressed = true;
+        grinderButtonPressedAt = millis();
+        wakeScreen(); // wake screen immediately
+        Serial.println("Grinder button pressed, screen waking...");
+    }
+    if (grindMode && grinderButtonPressed && millis() - grinderButtonPressedAt >= 600) {
+        grinderButtonPressed = false; // reset flag
+        events |= EVENT_BUTTON;
+    }
+
+    // Only allow cup trigger if grindMode == false
+    if (!grindMode &&
+        ABS(weightHistory.minSince(millis() - CUP_SETTLE_MS) - setCupWeight) < CUP_DETECTION_TOLERANCE &&
+        ABS(weightHistory.maxSince(millis() - CUP_SETTLE_MS) - setCupWeight) < CUP_DETECTION_TOLERANCE) {
+        events |= EVENT_CUP;
+    }
+    return events;
+}
+
+// Guards
+
+static bool menuAsked() { return requestedStatus.load() != STATUS_NONE; }
+static bool stopsShort() { return topUpMode && !scaleMode; }
+static bool relayStopped() { return !scaleMode && !isGrinderRunning(); }
+static bool relayStoppedShort() { return relayStopped() && stopsShort(); }
+static bool relayStoppedOnDose() { return relayStopped() && !stopsShort(); }
+static bool noWeight() { return scaleWeight <= 0; }
+static bool scaleLost() { return !scaleReady; }
+
+static bool firstGroundsLanded()
+{
+    return scaleMode && startedGrindingAt == 0 && scaleWeight - cupWeightEmpty >= 100;
+}
+
+static bool grindTooLong()
+{
+    return millis() - startedGrindingAt > MAX_GRINDING_TIME && !scaleMode;
+}
+
+static bool grindStalled()
+{
+    return millis() - startedGrindingAt > 2000 &&
+           scaleWeight - weightHistory.firstValueOlderThan(millis() - 2000) < 1000 &&
+           !scaleMode;
+}
+
+static bool cupRemoved()
+{
+    return weightHistory.minSince((int64_t)millis() - 200) < cupWeightEmpty - CUP_DETECTION_TOLERANCE && !scaleMode;
+}
+
+// Projects where the weight ends up once what is still in flight has landed
+static bool reachesTarget()
+{
+    int32_t currentOffset = 0;
+    projection.flow = 0;
     if (!scaleMode) {
-        if (grindMode) {
-            grinderActive = !grinderActive;
-            digitalWrite(GRINDER_ACTIVE_PIN, grinderActive);
-            Serial.print("Grinder toggled: ");
-            Serial.println(grinderActive ? "ON" : "OFF");
-        } else {
-            Serial.println("Grinder ON (Impulse Mode)");
-            digitalWrite(GRINDER_ACTIVE_PIN, 1);
-            delay(100);
-            digitalWrite(GRINDER_ACTIVE_PIN, 0);
-            Serial.println("Grinder OFF");
+        currentOffset = stopOffsetFor(grindTargetMg(), millis() - startedGrindingAt);
+        projection.flow = flowRateSince((int64_t)millis() - FLOW_WINDOW_MS);
+        if (projection.flow < 0) {
+            projection.flow = 0;
         }
     }
+    projection.weightNow = weightHistory.maxSince((int64_t)millis() - 200);
+    projection.inFlight = (int32_t)((int64_t)projection.flow * stopDelayMs / 1000);
+    projection.target = cupWeightEmpty + grindTargetMg() + currentOffset;
+    return projection.weightNow + projection.inFlight >= projection.target;
 }
 
-// Task to manage the status of the scale
-void scaleStatusLoop(void *p) {
-    for (;;) {
-        double tenSecAvg = weightHistory.averageSince((int64_t)millis() - 10000);
-        if (ABS(tenSecAvg - scaleWeight) > SIGNIFICANT_WEIGHT_CHANGE) {
-            lastSignificantWeightChangeAt = millis();
+static bool reachesTargetShort() { return stopsShort() && reachesTarget(); }
+static bool reachesDose() { return !stopsShort() && reachesTarget(); }
+static bool toppedUpDone() { return toppedUp; }
+static bool cupTaken() { return scaleWeight < 5000; }
+
+static bool finishedTimedOut()
+{
+    // 5-second delay after grinding finishes, and the cup has to be gone
+    return millis() - grindingFinishedAt > 5000 && scaleWeight < 3000;
+}
+
+static bool pressedToReset() { return scaleWeight >= GRINDING_FAILED_WEIGHT_TO_RESET; }
+
+// Actions
+
+static void takeMenuRequest()
+{
+    menuStatus = requestedStatus.exchange(STATUS_NONE);
+}
+
+static void clearShot()
+{
+    shotSettledWeight = 0;
+    startedGrindingAt = 0;
+    grindingFinishedAt = 0;
+    creepLearned = false;
+}
+
+static void startGrinding()
+{
+    clearShot(); // Nothing of the last shot carries over, however it was left
+    // The cup is still creeping, take the weight it will settle at
+    cupWeightEmpty = predictSettledWeight((int64_t)millis() - CUP_SETTLE_MS);
+    if (!scaleMode) {
+        newOffset = true;
+        startedGrindingAt = millis();
+    }
+    startGrinder();
+    Serial.println("Grinding started.");
+}
+
+// Hands the shot that just finished to the shot log. A topped up shot has settled by
+// now, otherwise the dose is what the stop left on its way to the cup.
+static void logFinishedShot()
+{
+    int32_t landing = weightAtStop + (int32_t)((int64_t)flowAtStop * stopDelayMs / 1000);
+    ShotRecord shot;
+    shot.targetMg = setWeight;
+    shot.actualMg = (shotSettledWeight != 0 ? shotSettledWeight : landing) - cupWeightEmpty;
+    shot.offsetMg = offsetAtStop;
+    shot.grindMs = grindMsAtStop;
+    shot.flowMgPerS = flowAtStop;
+    shot.cupMg = cupWeightEmpty;
+    shot.result = SHOT_FINISHED;
+    logShot(shot);
+}
+
+static void failShot(ShotResult result)
+{
+    stopGrinder();
+    ShotRecord shot;
+    shot.targetMg = setWeight;
+    shot.actualMg = scaleWeight - cupWeightEmpty;
+    shot.grindMs = millis() - startedGrindingAt;
+    shot.offsetMg = stopOffsetFor(grindTargetMg(), shot.grindMs);
+    shot.flowMgPerS = projection.flow;
+    shot.cupMg = cupWeightEmpty;
+    shot.result = result;
+    logShot(shot);
+}
+
+static void failOnNoWeight()
+{
+    // Avoid restarting grinding with zero or negative weight
+    Serial.println("Negative or zero weight detected. Skipping grinding.");
+    failShot(SHOT_NO_WEIGHT);
+}
+
+static void failOnScaleLost() { failShot(SHOT_SCALE_LOST); }
+static void failOnTooLong() { failShot(SHOT_TOO_LONG); }
+static void failOnStall() { failShot(SHOT_STALLED); }
+static void failOnCupRemoved() { failShot(SHOT_CUP_REMOVED); }
+
+static void startTimer() { startedGrindingAt = millis(); }
+
+static void stopOnTimer()
+{
+    // The relay timer made the stop
+    grindStopped((unsigned long)(grinderStoppedAtUs() / 1000), scheduledFlow, scheduledWeight);
+}
+
+static void stopAtTarget()
+{
+    stopGrinder();
+    grindStopped(millis(), projection.flow, projection.weightNow);
+}
+
+static void abandonTopUp()
+{
+    failShot(scaleReady ? SHOT_CUP_REMOVED : SHOT_SCALE_LOST);
+    topUpPulses = 0;
+    pulseRunning = false;
+    toppedUp = false;
+    startedGrindingAt = 0;
+}
+
+static void finishTopUp()
+{
+    topUpPulses = 0;
+    toppedUp = false;
+}
+
+static void emptyAfterShot()
+{
+    clearShot();
+    scaleWeight = 0;
+}
+
+static void timeOutAfterShot()
+{
+    clearShot();
+    Serial.println("Grinding finished. Transitioning to main menu.");
+}
+
+// Entries and activities
+
+// Close to the target, the relay timer stops the grinder when the projection gets
+// there, between readings; each reading moves the deadline to the newer projection.
+// The projection is as of when the reading was taken, so the deadline counts from
+// then and not from whenever this task got to run.
+static bool scheduleStop(uint8_t events)
+{
+    if (!(events & EVENT_SAMPLE) || scaleMode || projection.flow <= 0) {
+        return false;
+    }
+    int64_t remainingUs = (int64_t)(projection.target - projection.weightNow - projection.inFlight) * 1000000 / projection.flow;
+    if (remainingUs <= RELAY_STOP_HORIZON_MS * 1000) {
+        scheduledFlow = projection.flow;
+        scheduledWeight = projection.target - projection.inFlight;
+        scheduleGrinderStop(lastReadingAtUs + remainingUs);
+    } else {
+        cancelGrinderStop();
+    }
+    return false;
+}
+
+// Stopped short on purpose: once each landing has settled, pulse the grinder
+// for what is still missing at the learned pulse rate
+static bool pulseTopUp(uint8_t)
+{
+    if (pulseRunning) {
+        if (isGrinderRunning()) {
+            return false;
         }
+        pulseRunning = false;
+        finishedGrindingAt = (unsigned long)(grinderStoppedAtUs() / 1000);
+        groundsLandingMs = GROUNDS_LANDING_MS + stopDelayMs;
+    }
 
-        switch (scaleStatus) {
-            case STATUS_EMPTY: {
-                if (millis() - lastTareAt > TARE_MIN_INTERVAL && ABS(tenSecAvg) > 0.2 && tenSecAvg < 3 && scaleWeight < 3) {
-                    lastTareAt = 0; // Retare if conditions are met
-                }
-            
-                static bool grinderButtonPressed = false;
-                static unsigned long grinderButtonPressedAt = 0;
-            
-                // Only allow button trigger if grindMode == true
-                if (grindMode && digitalRead(GRIND_BUTTON_PIN) == LOW && !grinderButtonPressed) {
-                    grinderButtonPressed = true;
-                    grinderButtonPressedAt = millis();
-                    wakeScreen(); // wake screen immediately
-                    Serial.println("Grinder button pressed, screen waking...");
-                }
-            
-                if (grindMode && grinderButtonPressed && millis() - grinderButtonPressedAt >= 600) {
-                    grinderButtonPressed = false; // reset flag
-                    cupWeightEmpty = scaleWeight;
-                    scaleStatus = STATUS_GRINDING_IN_PROGRESS;
-                    if (!scaleMode) {
-                        newOffset = true;
-                        startedGrindingAt = millis();
-                    }
-                    grinderToggle();
-                    Serial.println("Grinding started after delay.");
-                    continue;
-                }
-            
-                // Only allow cup trigger if grindMode == false
-                if (!grindMode &&
-                    ABS(weightHistory.minSince(millis() - 1000) - setCupWeight) < CUP_DETECTION_TOLERANCE &&
-                    ABS(weightHistory.maxSince(millis() - 1000) - setCupWeight) < CUP_DETECTION_TOLERANCE) {
-                    
-                    cupWeightEmpty = weightHistory.averageSince(millis() - 500);
-                    scaleStatus = STATUS_GRINDING_IN_PROGRESS;
-                    if (!scaleMode) {
-                        newOffset = true;
-                        startedGrindingAt = millis();
-                    }
-                    grinderToggle();
-                    Serial.println("Grinding started from cup detection.");
-                    continue;
-                }
-            
-                break;
-            }            
-        case STATUS_GRINDING_IN_PROGRESS:
-        {
-            if (scaleWeight <= 0)
-            { // Avoid restarting grinding with zero or negative weight
-                Serial.println("Negative or zero weight detected. Skipping grinding.");
-                grinderToggle(); // Ensure grinder is off
-                scaleStatus = STATUS_GRINDING_FAILED;
-                continue;
-            }
-            if (!scaleReady)
-            {
-                grinderToggle();
-                scaleStatus = STATUS_GRINDING_FAILED;
-            }
-                if (scaleMode && startedGrindingAt == 0 && scaleWeight - cupWeightEmpty >= 0.1) {
-                startedGrindingAt = millis();
-                continue;
-            }
-                if (millis() - startedGrindingAt > MAX_GRINDING_TIME && !scaleMode) {
-                grinderToggle();
-                scaleStatus = STATUS_GRINDING_FAILED;
-                continue;
-            }
-            if (millis() - startedGrindingAt > 2000 &&
-                scaleWeight - weightHistory.firstValueOlderThan(millis() - 2000) < 1 &&
-                    !scaleMode) {
-                grinderToggle();
-                scaleStatus = STATUS_GRINDING_FAILED;
-                continue;
-            }
-                if (weightHistory.minSince((int64_t)millis() - 200) < cupWeightEmpty - CUP_DETECTION_TOLERANCE && !scaleMode) {
-                grinderToggle();
-                scaleStatus = STATUS_GRINDING_FAILED;
-                continue;
-            }
-            double currentOffset = offset;
-                if (scaleMode) {
-                currentOffset = 0;
-            }
-                if (weightHistory.maxSince((int64_t)millis() - 200) >= cupWeightEmpty + setWeight + currentOffset) {
-                finishedGrindingAt = millis();
-                grinderToggle();
-                scaleStatus = STATUS_GRINDING_FINISHED;
-                continue;
-            }
-            break;
+    int64_t landedAt = (int64_t)finishedGrindingAt + groundsLandingMs;
+    if ((int64_t)millis() <= landedAt + CREEP_FIT_MS) {
+        return false;
+    }
+    int32_t settledWeight = predictSettledWeight(landedAt);
+    shotSettledWeight = settledWeight;
+    if (newOffset) {
+        // The main grind learns against the dose it aimed for
+        learnFromStop(settledWeight, grindTargetMg());
+        newOffset = false;
+    } else if (topUpPulses > 0 && settledWeight > weightBeforePulse) {
+        int64_t observed = (int64_t)(settledWeight - weightBeforePulse) * 1000 / pulseMs;
+        if (observed < TOPUP_PULSE_RATE_MIN) {
+            observed = TOPUP_PULSE_RATE_MIN;
+        } else if (observed > TOPUP_PULSE_RATE_MAX) {
+            observed = TOPUP_PULSE_RATE_MAX;
         }
-        case STATUS_GRINDING_FINISHED:
-        {
-            static unsigned long grindingFinishedAt = 0;
-
-            // Record the time when grinding finished if not already recorded
-            if (grindingFinishedAt == 0)
-            {
-                grindingFinishedAt = millis();
-                Serial.print("Grinder was on for: ");
-                Serial.print(grindingFinishedAt);
-                Serial.println(" seconds");
-            }
+        pulseRateMgPerS = (uint32_t)((pulseRateMgPerS + observed) / 2);
+        settingLearned();
+    }
 
-            double currentWeight = weightHistory.averageSince((int64_t)millis() - 500);
-                if (scaleWeight < 5) {
-                startedGrindingAt = 0;
-                grindingFinishedAt = 0; // Reset the timestamp
-                scaleWeight = 0;
-                scaleStatus = STATUS_EMPTY;
-                continue;
-                } else if (currentWeight != setWeight + cupWeightEmpty && millis() - finishedGrindingAt > 1500 && newOffset) {
-                offset += setWeight + cupWeightEmpty - currentWeight;
-                    if (ABS(offset) >= setWeight) {
-                    offset = COFFEE_DOSE_OFFSET;
-                }
-                shotCount++;
-                preferences.begin("scale", false);
-                preferences.putDouble("offset", offset);
-                preferences.putUInt("shotCount", shotCount);
-                preferences.end();
-                newOffset = false;
-            }
+    // Done once close enough, or once even the shortest pulse would land further off
+    int32_t missing = cupWeightEmpty + setWeight - settledWeight;
+    int32_t shortestPulseMg = (int32_t)((int64_t)pulseRateMgPerS * TOPUP_PULSE_MIN_MS / 1000);
+    if (missing <= TOPUP_TOLERANCE || shortestPulseMg >= 2 * missing || topUpPulses >= TOPUP_MAX_PULSES) {
+        toppedUp = true;
+        return true;
+    }
+
+    pulseMs = (uint32_t)((int64_t)missing * 1000 / pulseRateMgPerS);
+    if (pulseMs < TOPUP_PULSE_MIN_MS) {
+        pulseMs = TOPUP_PULSE_MIN_MS;
+    } else if (pulseMs > TOPUP_PULSE_MAX_MS) {
+        pulseMs = TOPUP_PULSE_MAX_MS;
+    }
+    weightBeforePulse = settledWeight;
+    topUpPulses++;
+    pulseRunning = true;
+    // The relay timer ends the pulse, to the microsecond
+    startGrinder();
+    scheduleGrinderStop(esp_timer_get_time() + (int64_t)pulseMs * 1000);
+    return false;
+}
+
+// Logged on the way in, the menus or the screen going to sleep can take the status
+// elsewhere before the cup leaves
+static void enterFinished()
+{
+    logFinishedShot();
+    grindingFinishedAt = millis();
+    Serial.print("Grinder was on for: ");
+    Serial.print(grindingFinishedAt);
+    Serial.println(" seconds");
+}
+
+static bool learnAfterShot(uint8_t)
+{
+    int64_t landedAt = (int64_t)finishedGrindingAt + groundsLandingMs;
+    if (newOffset && (int64_t)millis() > landedAt + CREEP_FIT_MS) {
+        // Predict the settled weight rather than wait for the creep to play out
+        learnFromStop(predictSettledWeight(landedAt), grindTargetMg());
+    } else if (!creepLearned && !scaleMode && (int64_t)millis() >= landedAt + 3 * CREEP_LEARN_SPACING_MS) {
+        // The cup has sat through a whole settle, refine this load cell's creep time constant
+        creepLearned = true;
+        bool learned = creepModel.learn(averageBetween(landedAt, landedAt + CREEP_LEARN_SPACING_MS),
+                                        averageBetween(landedAt + CREEP_LEARN_SPACING_MS, landedAt + 2 * CREEP_LEARN_SPACING_MS),
+                                        averageBetween(landedAt + 2 * CREEP_LEARN_SPACING_MS, landedAt + 3 * CREEP_LEARN_SPACING_MS),
+                                        CREEP_LEARN_SPACING_MS);
+        if (learned) {
+            settingLearned();
+        }
+    }
+    if (millis() - grindingFinishedAt > 5000 && scaleWeight >= 3000) {
+        Serial.println("Waiting for cup to be removed...");
+    }
+    return false;
+}
+
+static const StatusTransition statusTransitions[] = {
+    {STATUS_ANY, EVENT_MENU, menuAsked, takeMenuRequest, STATUS_REQUESTED},
+
+    {STATUS_EMPTY, EVENT_BUTTON, nullptr, startGrinding, STATUS_GRINDING_IN_PROGRESS},
+    {STATUS_EMPTY, EVENT_CUP, nullptr, startGrinding, STATUS_GRINDING_IN_PROGRESS},
+
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_TIMEOUT, relayStoppedShort, stopOnTimer, STATUS_TOPPING_UP},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_TIMEOUT, relayStoppedOnDose, stopOnTimer, STATUS_GRINDING_FINISHED},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_SAMPLE, noWeight, failOnNoWeight, STATUS_GRINDING_FAILED},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_TIMEOUT, scaleLost, failOnScaleLost, STATUS_GRINDING_FAILED},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_SAMPLE, firstGroundsLanded, startTimer, STATUS_GRINDING_IN_PROGRESS},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_TIMEOUT, grindTooLong, failOnTooLong, STATUS_GRINDING_FAILED},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_SAMPLE, grindStalled, failOnStall, STATUS_GRINDING_FAILED},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_SAMPLE, cupRemoved, failOnCupRemoved, STATUS_GRINDING_FAILED},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_SAMPLE, reachesTargetShort, stopAtTarget, STATUS_TOPPING_UP},
+    {STATUS_GRINDING_IN_PROGRESS, EVENT_SAMPLE, reachesDose, stopAtTarget, STATUS_GRINDING_FINISHED},
+
+    {STATUS_TOPPING_UP, EVENT_TIMEOUT, scaleLost, abandonTopUp, STATUS_GRINDING_FAILED},
+    {STATUS_TOPPING_UP, EVENT_SAMPLE, cupTaken, abandonTopUp, STATUS_EMPTY},
+    {STATUS_TOPPING_UP, EVENT_TIMEOUT, toppedUpDone, finishTopUp, STATUS_GRINDING_FINISHED},
+
+    {STATUS_GRINDING_FINISHED, EVENT_SAMPLE, cupTaken, emptyAfterShot, STATUS_EMPTY},
+    {STATUS_GRINDING_FINISHED, EVENT_TIMEOUT, finishedTimedOut, timeOutAfterShot, STATUS_EMPTY},
+
+    {STATUS_GRINDING_FAILED, EVENT_SAMPLE, pressedToReset, nullptr, STATUS_EMPTY},
+};
+
+static const StatusBehaviour statusBehaviours[] = {
+    {STATUS_GRINDING_IN_PROGRESS, nullptr, scheduleStop},
+    {STATUS_TOPPING_UP, nullptr, pulseTopUp},
+    {STATUS_GRINDING_FINISHED, enterFinished, learnAfterShot},
+};
+
+static const StatusBehaviour *behaviourOf(int status)
+{
+    for (const StatusBehaviour &behaviour : statusBehaviours) {
+        if (behaviour.status == status) {
+            return &behaviour;
+        }
+    }
+    return nullptr;
+}
+
+// Evaluates the grind state machine once for the events that came in, returns true
+// when it changed state and wants to be evaluated again right away
+bool scaleStatusStep(uint8_t events) {
+    // A reading counts from when it was taken, a timeout from when the task woke
+    int64_t eventAtUs = (events & EVENT_SAMPLE) ? lastReadingAtUs : esp_timer_get_time();
+    int32_t tenSecAvg = weightHistory.averageSince((int64_t)millis() - 10000);
+    if (ABS(tenSecAvg - scaleWeight) > SIGNIFICANT_WEIGHT_CHANGE) {
+        lastSignificantWeightChangeAt = millis();
+    }
+
+    // The clocks and the menus are looked at on every step
+    events |= EVENT_TIMEOUT | pollStartEvents();
+    if (menuAsked()) {
+        events |= EVENT_MENU;
+    }
+    if (transitionStatsReset.exchange(false)) {
+        memset(transitionTable, 0, sizeof(transitionTable));
+    }
+    reportGrinderSwitches(); // Including the stop timer's, which doesn't print from its callback
+
+    int from = scaleStatus;
+    if (grindSimulated && from == STATUS_GRINDING_IN_PROGRESS) {
+        // Neither the relay nor the weight have anything to do with it, so nothing may
+        // finish, fail or log it; only the menu takes it back
+        if (!menuAsked()) {
+            return false;
+        }
+        events = EVENT_MENU;
+    }
+    for (const StatusTransition &transition : statusTransitions) {
+        uint8_t fired = transition.events & events;
+        if ((transition.from != STATUS_ANY && transition.from != from) || !fired ||
+            (transition.guard != nullptr && !transition.guard())) {
+            continue;
+        }
+        if (transition.action != nullptr) {
+            transition.action();
+        }
+        int to = transition.to == STATUS_REQUESTED ? menuStatus : transition.to;
+        scaleStatus = to;
+        const StatusBehaviour *behaviour = behaviourOf(to);
+        if (to != from && behaviour != nullptr && behaviour->enter != nullptr) {
+            behaviour->enter();
+        }
+        recordTransition(from, to, fired, eventAtUs);
+        return true;
+    }
+
+    const StatusBehaviour *behaviour = behaviourOf(from);
+    return behaviour != nullptr && behaviour->activity != nullptr && behaviour->activity(events);
+}
+
+// For the menus and the display, which take the status out of the grind's hands. Only
+// asks for it: the status task's next step applies it, the latest request winning.
+void setScaleStatus(int status)
+{
+    // Nothing to change, unless it undoes a request still waiting
+    if (status == scaleStatus && !menuAsked()) {
+        return;
+    }
+    requestedStatus.store(status);
+    if (ScaleStatusTask != nullptr) {
+        xTaskNotify(ScaleStatusTask, EVENT_MENU, eSetBits);
+    }
+}
+
+const TransitionStats &transitionStats(int from, int to)
+{
+    return transitionTable[from][to];
+}
+
+// Takes effect on the next step
+void resetTransitionStats()
+{
+    transitionStatsReset.store(true);
+}
 
-            // Timeout to transition back to the main menu after grinding finishes
-            if (millis() - grindingFinishedAt > 5000)
-            { // 5-second delay after grinding finishes
-                if (scaleWeight >= 3)
-                { // If weight is still on the scale, wait for cup removal
-                    Serial.println("Waiting for cup to be removed...");
-                }
-                else
-                {
-                    startedGrindingAt = 0;
-                    grindingFinishedAt = 0; // Reset the timestamp
-                    scaleStatus = STATUS_EMPTY;
-                    Serial.println("Grinding finished. Transitioning to main menu.");
-                }
+// The transition that took longest to decide since boot, false if none was taken yet
+bool worstTransition(int &from, int &to)
+{
+    bool found = false;
+    for (int i = 0; i < STATUS_COUNT; i++) {
+        for (int j = 0; j < STATUS_COUNT; j++) {
+            if (transitionTable[i][j].count > 0 &&
+                (!found || transitionTable[i][j].worstLatencyUs > transitionTable[from][to].worstLatencyUs)) {
+                from = i;
+                to = j;
+                found = true;
             }
-            break;
         }
-        case STATUS_GRINDING_FAILED:
-        {
-            if (scaleWeight >= GRINDING_FAILED_WEIGHT_TO_RESET)
-            {
-                scaleStatus = STATUS_EMPTY;
+    }
+    return found;
+}
+
+void printTransitionStats()
+{
+    Serial.println("# from -> to: count, last at ms (event), last/worst decision us");
+    for (int from = 0; from < STATUS_COUNT; from++) {
+        for (int to = 0; to < STATUS_COUNT; to++) {
+            const TransitionStats &stats = transitionTable[from][to];
+            if (stats.count == 0) {
                 continue;
             }
-            break;
+            Serial.printf("%d -> %d: %lu, %lu (0x%02x), %lu/%lu\n", from, to, (unsigned long)stats.count,
+                          (unsigned long)stats.lastAtMs, (unsigned)stats.lastEvent,
+                          (unsigned long)stats.lastLatencyUs, (unsigned long)stats.worstLatencyUs);
         }
+    }
+}
+
+// Task running the grind state machine on each new reading or menu request, as soon as
+// it is posted as an EVENT_ bit. The timeout keeps its timers going while nothing comes in.
+void scaleStatusLoop(void *p) {
+    for (;;) {
+        uint32_t events = 0;
+        if (xTaskNotifyWait(0, UINT32_MAX, &events, pdMS_TO_TICKS(STATUS_IDLE_TIMEOUT_MS)) != pdTRUE) {
+            events = EVENT_TIMEOUT;
+        }
+        while (scaleStatusStep(events)) {
         }
-        rotary_loop();
-        delay(50);
     }
 }
 
@@ -262,31 +1016,52 @@ void setupScale() {
     rotaryEncoder.setAcceleration(100);
 
     loadcell.begin(LOADCELL_DOUT_PIN, LOADCELL_SCK_PIN);
-    pinMode(GRINDER_ACTIVE_PIN, OUTPUT);
+    setupRelay();
     pinMode(GRIND_BUTTON_PIN, INPUT_PULLUP);
-    digitalWrite(GRINDER_ACTIVE_PIN, 0);
 
-    preferences.begin("scale", false);
-    
-    double scaleFactor = preferences.getDouble("calibration", (double)LOADCELL_SCALE_FACTOR);
+    // Everything in one NVS read, moved over from the old one-key-per-setting layout if need be
+    StoredSettings settings;
+    loadSettings(settings);
+
+    bool repaired = false;
+    double scaleFactor = settings.countsPerGram;
     if (scaleFactor <= 0 || std::isnan(scaleFactor)) {
-    scaleFactor = LOADCELL_SCALE_FACTOR;
-    preferences.putDouble("calibration", scaleFactor);
-    Serial.println("Invalid scale factor detected. Resetting to default.");
-    }
-    setWeight = preferences.getDouble("setWeight", (double)COFFEE_DOSE_WEIGHT);
-    offset = preferences.getDouble("offset", (double)COFFEE_DOSE_OFFSET);
-    setCupWeight = preferences.getDouble("cup", (double)CUP_WEIGHT);
-    scaleMode = preferences.getBool("scaleMode", false);
-    grindMode = preferences.getBool("grindMode", false);
-    shotCount = preferences.getUInt("shotCount", 0);
-    sleepTime = preferences.getInt("sleepTime", SLEEP_AFTER_MS); // Default to SLEEP_AFTER_MS if not set
-    useButtonToGrind = preferences.getBool("grindTrigger", DEFAULT_GRIND_TRIGGER_MODE);
-    preferences.end();
-  Serial.printf("→ scaleFactor = %.0f  |  offset = %.0f\n", scaleFactor, offset);
-    loadcell.set_scale(scaleFactor);
-    loadcell.set_offset(offset);
-
-    xTaskCreatePinnedToCore(updateScale, "Scale", 10000, NULL, 0, &ScaleTask, 1);
-    xTaskCreatePinnedToCore(scaleStatusLoop, "ScaleStatus", 10000, NULL, 0, &ScaleStatusTask, 1);
+        scaleFactor = LOADCELL_SCALE_FACTOR;
+        repaired = true;
+        Serial.println("Invalid scale factor detected. Resetting to default.");
+    }
+    setWeight = settings.setWeight;
+    offset = settings.offset;
+    setCupWeight = settings.cupWeight;
+    scaleMode = settings.scaleMode;
+    grindMode = settings.grindMode;
+    shotCount = recoverShotCount(settings.shotCount);
+    sleepTime = settings.sleepTime;
+    useButtonToGrind = settings.grindTrigger;
+    creepModel.setTimeConstant(settings.creepTimeConstantMs);
+    memcpy(offsetTable.data(), settings.offsetTable, StopOffsetTable::bytes());
+    stopDelayMs = settings.stopDelayMs;
+    if (stopDelayMs > STOP_DELAY_MAX_MS) {
+        stopDelayMs = STOP_DELAY_MS;
+    }
+    topUpMode = settings.topUp;
+    pulseRateMgPerS = settings.pulseRateMgPerS;
+    if (pulseRateMgPerS < TOPUP_PULSE_RATE_MIN || pulseRateMgPerS > TOPUP_PULSE_RATE_MAX) {
+        pulseRateMgPerS = TOPUP_PULSE_RATE;
+    }
+  Serial.printf("→ scaleFactor = %.0f  |  offset = %.2f\n", scaleFactor, mgToGrams(offset));
+    setScaleFactor(scaleFactor);
+    driftCountsPerDegree = settings.gramsPerDegreeDrift * MG_PER_GRAM * 65536 / mgPerCountQ16;
+    if (repaired) {
+        saveSettings();
+    }
+    esp_register_shutdown_handler(checkpointSettings); // Shots counted since the last checkpoint survive ESP.restart()
+
+    tareScale(); // Zero from the first steady readings
+    // Readings and the grind control run above the display and the menus, which can't hold them up
+    xTaskCreatePinnedToCore(updateScale, "Scale", 10000, NULL, 2, &ScaleTask, 1);
+    attachInterrupt(digitalPinToInterrupt(LOADCELL_DOUT_PIN), onLoadcellReady, FALLING);
+    xTaskCreatePinnedToCore(scaleStatusLoop, "ScaleStatus", 10000, NULL, 2, &ScaleStatusTask, 1);
+    xTaskCreatePinnedToCore(updateRotary, "Rotary", 10000, NULL, 0, &RotaryTask, 1);
+    xTaskCreatePinnedToCore(updateSettings, "Settings", 4096, NULL, 0, &SettingsTask, 1);
 }
@@ -0,0 +1,236 @@
+#include <atomic>
+#include <string.h>
+#include <Crc32.h>
+#include "config.hpp"
+#include "settings.hpp"
+
+// All scale settings live in one StoredSettings blob under SETTINGS_KEY, read once at
+// boot and always rewritten whole. NVS replaces a blob only once the new copy is
+// complete, and the CRC catches anything that still got mangled on the way.
+//
+// The menu settings live in their globals; changing one only marks it dirty. A low
+// priority task saves once the dirty settings have been left alone for
+// SETTINGS_WRITE_IDLE_MS, so spinning the dial costs one flash write, not one per detent.
+//
+// Shots are counted in RTC memory, which keeps its contents through a soft reset, and
+// only every SHOT_CHECKPOINT_SHOTS-th shot saves the blob, with everything learned
+// since. A restart saves too, so only a power cut or a crash loses shots, fewer than
+// SHOT_CHECKPOINT_SHOTS of them.
+
+#define SETTINGS_KEY "settings"
+
+// Keys released firmware stored the settings under, one each, before the blob
+static const char *const oldKeys[] = {"calibration", "setWeight", "offset", "cup", "scaleMode", "grindMode", "shotCount", "sleepTime",
+                                      "grindTrigger"};
+
+static std::atomic<uint32_t> dirtySettings(0); // one bit per Setting
+static std::atomic<bool> learnedDirty(false);  // learned since the last save, waits for a checkpoint
+static volatile unsigned long changedAt[SETTING_COUNT];
+static std::atomic<bool> saving(false); // the display, web and settings tasks can all save
+
+// Left alone by the boot code, so after a soft reset it still holds the count
+struct ShotCounter {
+    uint32_t checkpointed; // shotCount in NVS
+    uint32_t count;        // shotCount as counted
+    uint32_t crc;          // anything else is left over from a power cut
+};
+RTC_NOINIT_ATTR static ShotCounter shotCounter;
+
+static void keepShotCount(uint32_t checkpointed, uint32_t count)
+{
+    shotCounter.checkpointed = checkpointed;
+    shotCounter.count = count;
+    shotCounter.crc = crc32(&shotCounter, offsetof(ShotCounter, crc));
+}
+
+static uint32_t settingsCrc(const StoredSettings &settings)
+{
+    return crc32(&settings, offsetof(StoredSettings, crc));
+}
+
+StoredSettings defaultSettings()
+{
+    StoredSettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.version = SETTINGS_VERSION;
+    settings.size = sizeof(StoredSettings);
+    settings.countsPerGram = LOADCELL_SCALE_FACTOR;
+    settings.setWeight = COFFEE_DOSE_WEIGHT;
+    settings.offset = COFFEE_DOSE_OFFSET;
+    settings.cupWeight = CUP_WEIGHT;
+    settings.sleepTime = SLEEP_AFTER_MS;
+    settings.grindTrigger = DEFAULT_GRIND_TRIGGER_MODE;
+    settings.creepTimeConstantMs = CREEP_TIME_CONSTANT_MS;
+    settings.stopDelayMs = STOP_DELAY_MS;
+    settings.pulseRateMgPerS = TOPUP_PULSE_RATE;
+    settings.crc = settingsCrc(settings);
+    return settings;
+}
+
+static bool hasOldSettings()
+{
+    for (const char *key : oldKeys) {
+        if (preferences.isKey(key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Settings from before the blob, one key each; the namespace must be open for writing
+static void migrateSettings(StoredSettings &settings)
+{
+    settings.countsPerGram = preferences.getDouble("calibration", settings.countsPerGram);
+    settings.setWeight = gramsToMg(preferences.getDouble("setWeight", mgToGrams(settings.setWeight)));
+    settings.offset = gramsToMg(preferences.getDouble("offset", mgToGrams(settings.offset)));
+    settings.cupWeight = gramsToMg(preferences.getDouble("cup", mgToGrams(settings.cupWeight)));
+    settings.scaleMode = preferences.getBool("scaleMode", settings.scaleMode);
+    settings.grindMode = preferences.getBool("grindMode", settings.grindMode);
+    settings.shotCount = preferences.getUInt("shotCount", settings.shotCount);
+    settings.sleepTime = preferences.getInt("sleepTime", settings.sleepTime);
+    settings.grindTrigger = preferences.getBool("grindTrigger", settings.grindTrigger);
+    settings.crc = settingsCrc(settings);
+
+    // Written before the old keys go, so a reset in between only leaves them behind
+    preferences.putBytes(SETTINGS_KEY, &settings, sizeof(settings));
+    for (const char *key : oldKeys) {
+        preferences.remove(key);
+    }
+    Serial.println("Settings moved to a single blob.");
+}
+
+// Reads the stored settings in one go, returns false when they had to fall back to the defaults
+bool loadSettings(StoredSettings &settings)
+{
+    settings = defaultSettings();
+    preferences.begin("scale", false);
+    size_t length = preferences.getBytesLength(SETTINGS_KEY);
+    bool loaded = false;
+    if (length == sizeof(StoredSettings)) {
+        StoredSettings stored;
+        preferences.getBytes(SETTINGS_KEY, &stored, sizeof(stored));
+        if (stored.version == SETTINGS_VERSION && stored.size == sizeof(StoredSettings) && stored.crc == settingsCrc(stored)) {
+            settings = stored;
+            loaded = true;
+        } else {
+            Serial.println("Stored settings are damaged, using defaults.");
+        }
+    } else if (length == 0 && hasOldSettings()) {
+        migrateSettings(settings);
+        loaded = true;
+    } else if (length > 0) {
+        Serial.println("Stored settings don't fit this firmware, using defaults.");
+    }
+    preferences.end();
+    return loaded;
+}
+
+// Writes every setting as it is right now, in one NVS write
+void saveSettings()
+{
+    while (saving.exchange(true)) {
+        delay(1);
+    }
+    // Clean before the values are read, so a change made meanwhile marks them dirty again
+    dirtySettings.store(0);
+    learnedDirty.store(false);
+
+    StoredSettings settings = defaultSettings();
+    settings.countsPerGram = loadcellCountsPerGram;
+    settings.setWeight = setWeight;
+    settings.offset = offset;
+    settings.cupWeight = setCupWeight;
+    settings.sleepTime = sleepTime;
+    settings.scaleMode = scaleMode;
+    settings.grindMode = grindMode;
+    settings.grindTrigger = useButtonToGrind;
+    settings.topUp = topUpMode;
+    settings.shotCount = shotCount;
+    settings.gramsPerDegreeDrift = mgToGrams(1) * driftCountsPerDegree * mgPerCountQ16 / 65536;
+    settings.creepTimeConstantMs = creepModel.getTimeConstant();
+    settings.stopDelayMs = stopDelayMs;
+    settings.pulseRateMgPerS = pulseRateMgPerS;
+    memcpy(settings.offsetTable, offsetTable.data(), StopOffsetTable::bytes());
+    settings.crc = settingsCrc(settings);
+
+    preferences.begin("scale", false);
+    preferences.putBytes(SETTINGS_KEY, &settings, sizeof(settings));
+    preferences.end();
+    keepShotCount(settings.shotCount, settings.shotCount);
+    saving.store(false);
+}
+
+void settingChanged(Setting setting)
+{
+    changedAt[setting] = millis();
+    dirtySettings.fetch_or(1u << setting);
+}
+
+// Saves once a dirty setting has been left alone for SETTINGS_WRITE_IDLE_MS
+bool writeRestingSettings()
+{
+    uint32_t dirty = dirtySettings.load();
+    for (int i = 0; i < SETTING_COUNT; i++) {
+        if ((dirty & (1u << i)) && millis() - changedAt[i] >= SETTINGS_WRITE_IDLE_MS) {
+            saveSettings();
+            return true;
+        }
+    }
+    return false;
+}
+
+// For what the scale learns by itself as it goes, saved with the next checkpoint
+void settingLearned()
+{
+    learnedDirty.store(true);
+}
+
+// Saves right away if a menu setting is dirty, before the screen sleeps or the chip restarts
+void flushSettings()
+{
+    if (dirtySettings.load() != 0) {
+        saveSettings();
+    }
+}
+
+// Saves whatever NVS doesn't have yet, shots and learned values included, on the way
+// into a restart
+void checkpointSettings()
+{
+    if (dirtySettings.load() != 0 || learnedDirty.load() || shotCount != shotCounter.checkpointed) {
+        saveSettings();
+    }
+}
+
+// Counts a finished shot, saving everything learned from the shots every SHOT_CHECKPOINT_SHOTS
+void countShot()
+{
+    shotCount++;
+    if (shotCount - shotCounter.checkpointed >= SHOT_CHECKPOINT_SHOTS) {
+        saveSettings();
+    } else {
+        keepShotCount(shotCounter.checkpointed, shotCount);
+    }
+}
+
+// The shot count to carry on from at boot: the one in RTC memory if it survived and
+// belongs to what NVS holds, else the last checkpoint
+uint32_t recoverShotCount(uint32_t storedShotCount)
+{
+    bool survived = shotCounter.crc == crc32(&shotCounter, offsetof(ShotCounter, crc)) &&
+                    shotCounter.checkpointed == storedShotCount &&
+                    shotCounter.count - storedShotCount < SHOT_CHECKPOINT_SHOTS;
+    uint32_t recovered = survived ? shotCounter.count : storedShotCount;
+    keepShotCount(storedShotCount, recovered);
+    return recovered;
+}
+
+// Task writing settings back once they rest
+void updateSettings(void *parameter)
+{
+    for (;;)
+    {
+        writeRestingSettings();
+        delay(SETTINGS_POLL_MS);
+    }
+}
@@ -0,0 +1,188 @@
+#include <atomic>
+#include <LittleFS.h>
+#include <RecordRing.h>
+#include "config.hpp"
+#include "shotlog.hpp"
+
+// Every shot, finished or failed, as a fixed-size record in a ring of segment files on
+// LittleFS. Records are only ever appended; once the ring comes round to the oldest
+// segment that file is started over, so nothing is rewritten in place. The grind state
+// machine only hands the record over; the logger task does the flash write, so a slow
+// one can't hold up a stop.
+
+#define SHOT_LOG_DIR "/shots"
+#define SHOT_LOG_OLD_PATH "/shots.bin" // the single file written in place, before the segments
+
+static_assert(SHOT_LOG_SLOTS % SHOT_LOG_SEGMENT_SLOTS == 0, "the ring needs a whole number of segments");
+
+// The ring's slots, SHOT_LOG_SEGMENT_SLOTS to a file
+class ShotLogFile {
+public:
+    bool open(size_t slotBytes)
+    {
+        segmentBytes = SHOT_LOG_SEGMENT_SLOTS * slotBytes;
+        if (LittleFS.exists(SHOT_LOG_OLD_PATH)) {
+            LittleFS.remove(SHOT_LOG_OLD_PATH);
+        }
+        return LittleFS.exists(SHOT_LOG_DIR) || LittleFS.mkdir(SHOT_LOG_DIR);
+    }
+
+    // Fails for slots past the end of their segment, which the ring takes as empty
+    bool read(size_t offset, void *data, size_t length)
+    {
+        const char *path = segmentPath(offset / segmentBytes);
+        if (!LittleFS.exists(path)) {
+            return false;
+        }
+        File file = LittleFS.open(path, "r");
+        bool found = file && file.seek(offset % segmentBytes) && file.read((uint8_t *)data, length) == length;
+        file.close();
+        return found;
+    }
+
+    // The ring writes its slots in order, so this is an append to the newest segment,
+    // or, at a segment's first slot, the oldest segment started over
+    bool write(size_t offset, const void *data, size_t length)
+    {
+        size_t at = offset % segmentBytes;
+        const char *path = segmentPath(offset / segmentBytes);
+        File file = LittleFS.open(path, at == 0 ? "w" : "a");
+        if (!file) {
+            return false;
+        }
+        size_t size = file.size();
+        if (size > at) {
+            // A damaged record after the newest one: the only write that lands in place
+            file.close();
+            file = LittleFS.open(path, "r+");
+            if (!file || !file.seek(at)) {
+                return false;
+            }
+            size = at;
+        }
+        // Slots a failed write left out are filled in as empty
+        uint8_t empty[32] = {};
+        bool written = true;
+        for (; written && size < at; size += sizeof(empty)) {
+            size_t chunk = at - size < sizeof(empty) ? at - size : sizeof(empty);
+            written = file.write(empty, chunk) == chunk;
+        }
+        written = written && file.write((const uint8_t *)data, length) == length;
+        file.close();
+        return written;
+    }
+
+private:
+    const char *segmentPath(size_t segment)
+    {
+        snprintf(path, sizeof(path), SHOT_LOG_DIR "/%u.bin", (unsigned)segment);
+        return path;
+    }
+
+    size_t segmentBytes = 0;
+    char path[24];
+};
+
+using ShotLog = RecordRing<ShotRecord, SHOT_LOG_SLOTS, SHOT_LOG_INDEX_STRIDE, ShotLogFile>;
+
+static ShotLogFile shotLogFile;
+static ShotLog shotLog(shotLogFile);
+static bool shotLogReady = false;
+static std::atomic<bool> shotLogBusy(false); // the logger task and the debug menu share the files
+
+// Shots handed over by the grind state machine, waiting for the logger task
+static ShotRecord pendingShots[SHOT_LOG_PENDING];
+static std::atomic<uint32_t> pendingAdded(0);
+static std::atomic<uint32_t> pendingWritten(0);
+
+static void lockShotLog()
+{
+    while (shotLogBusy.exchange(true)) {
+        delay(1);
+    }
+}
+
+static void unlockShotLog()
+{
+    shotLogBusy.store(false);
+}
+
+void setupShotLog()
+{
+    if (!LittleFS.begin(true) || !shotLogFile.open(ShotLog::slotBytes())) {
+        Serial.println("Shot log unavailable.");
+        return;
+    }
+    shotLog.load();
+    shotLogReady = true;
+    Serial.printf("Shot log: next shot is #%lu\n", (unsigned long)shotLog.nextSequence());
+    xTaskCreatePinnedToCore(updateShotLog, "ShotLog", 4096, NULL, 0, &ShotLogTask, 1);
+}
+
+// Hands a shot to the logger task without waiting on flash, false if it is too far behind
+bool logShot(const ShotRecord &shot)
+{
+    uint32_t added = pendingAdded.load();
+    if (added - pendingWritten.load() >= SHOT_LOG_PENDING) {
+        return false;
+    }
+    pendingShots[added % SHOT_LOG_PENDING] = shot;
+    pendingAdded.store(added + 1);
+    if (ShotLogTask != nullptr) {
+        xTaskNotifyGive(ShotLogTask);
+    }
+    return true;
+}
+
+size_t readShots(uint32_t firstSequence, ShotRecord *shots, size_t maxCount)
+{
+    if (!shotLogReady) {
+        return 0;
+    }
+    lockShotLog();
+    size_t count = shotLog.read(firstSequence, shots, maxCount);
+    unlockShotLog();
+    return count;
+}
+
+uint32_t nextShotSequence()
+{
+    return shotLog.nextSequence();
+}
+
+// Prints the last count shots over serial, oldest first
+void printShotLog(size_t count)
+{
+    uint32_t next = nextShotSequence();
+    uint32_t first = next > count ? next - count : 1;
+    Serial.printf("# shots %lu to %lu: target mg, actual mg, offset mg, grind ms, flow mg/s, cup mg, result\n",
+                  (unsigned long)first, (unsigned long)next - 1);
+    ShotRecord shots[8];
+    for (; first < next; first += 8) {
+        // Each read looks at the next 8 shots, a torn or damaged one is just left out
+        size_t read = readShots(first, shots, 8);
+        for (size_t i = 0; i < read; i++) {
+            Serial.printf("%ld, %ld, %ld, %lu, %ld, %ld, %u\n", (long)shots[i].targetMg, (long)shots[i].actualMg,
+                          (long)shots[i].offsetMg, (unsigned long)shots[i].grindMs, (long)shots[i].flowMgPerS,
+                          (long)shots[i].cupMg, (unsigned)shots[i].result);
+        }
+    }
+}
+
+// Task writing handed over shots to flash
+void updateShotLog(void *parameter)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (pendingWritten.load() != pendingAdded.load()) {
+            lockShotLog();
+            bool written = shotLog.append(pendingShots[pendingWritten.load() % SHOT_LOG_PENDING]);
+            unlockShotLog();
+            if (!written) {
+                Serial.println("Shot log write failed.");
+            }
+            pendingWritten.fetch_add(1);
+        }
+    }
+}
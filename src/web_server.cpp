@@ -3,6 +3,7 @@
 #include <ESPAsyncWebServer.h>
 #include "api_handler.hpp"
 #include "config.hpp"
+#include "settings.hpp"
 
 AsyncWebServer server(80);
 
@@ -68,6 +69,7 @@ void handleWiFiConfig(AsyncWebServerRequest *request) {
         Serial.println("WiFi credentials SAVED. Rebooting in 5 seconds...");
         request->send(200, "text/plain", "WiFi credentials SAVED. Rebooting...");
         delay(5000);
+        flushSettings();
         ESP.restart();
     } else {
         Serial.println("Missing SSID or Password");
@@ -108,6 +110,7 @@ void setupWebServer() {
         Serial.println("WiFi credentials erased. Rebooting in 5 seconds...");
         request->send(200, "text/plain", "WiFi credentials ERASED. Rebooting...");        
         delay(5000);
+        flushSettings();
         ESP.restart();
     });
 
@@ -0,0 +1,89 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <esp_timer.h>
+#include <MathBuffer.h>
+#include <FixedKalmanFilter.h>
+#include <chrono>
+#include "config.hpp"
+#include "scale.hpp"
+
+// Microbenchmarks for the hot paths. Numbers are host nanoseconds, useful for
+// spotting regressions and complexity changes rather than device timing.
+
+static volatile int64_t sink;
+
+template<typename F> static double nanosPerCall(int iterations, F body) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    body(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+static void report(const char *name, double nanos) {
+  char message[96];
+  snprintf(message, sizeof(message), "%-36s %8.1f ns", name, nanos);
+  TEST_MESSAGE(message);
+}
+
+void setUp() {}
+void tearDown() {}
+
+template<size_t S> static void benchmarkWindowQueries(const char *label) {
+  static MathBuffer<int32_t, S> buffer;
+  for (size_t i = 0; i < S; i++) {
+    native::advanceMillis(1);
+    buffer.push(i & 0xff);
+  }
+  int64_t cutoff = (int64_t)millis() - S / 2;
+
+  char name[48];
+  snprintf(name, sizeof(name), "averageSince, %s", label);
+  report(name, nanosPerCall(100000, [&](int) { sink = buffer.averageSince(cutoff); }));
+  snprintf(name, sizeof(name), "maxSince, %s", label);
+  report(name, nanosPerCall(100000, [&](int) { sink = buffer.maxSince(cutoff); }));
+
+  // The scan every query used to do, for comparison
+  snprintf(name, sizeof(name), "linear scan reference, %s", label);
+  report(name, nanosPerCall(10000, [&](int) {
+    int64_t sum = 0;
+    buffer.executeOnSamplesSince(cutoff, [&sum](int32_t value, int64_t ms) { sum += value; });
+    sink = sum;
+  }));
+}
+
+void test_benchmark_math_buffer() {
+  static MathBuffer<int32_t, 100> buffer;
+  report("push", nanosPerCall(1000000, [](int i) {
+    native::advanceMillis(1);
+    buffer.push(i & 0xfff);
+  }));
+
+  benchmarkWindowQueries<100>("100 samples");
+  benchmarkWindowQueries<4000>("4000 samples");
+  TEST_ASSERT_TRUE(true);
+}
+
+void test_benchmark_sample_path() {
+  FixedKalmanFilter filter(20, 20, FIXED_Q16(0.01));
+  report("FixedKalmanFilter::updateEstimate", nanosPerCall(1000000, [&](int i) { sink = filter.updateEstimate(i & 0x3ff); }));
+
+  setScaleFactor(LOADCELL_SCALE_FACTOR);
+  report("processScaleReading", nanosPerCall(100000, [](int i) {
+    native::advanceMillis(12);
+    processScaleReading(50000 + (i & 0x3f), esp_timer_get_time());
+  }));
+  report("scaleStatusStep (empty)", nanosPerCall(100000, [](int) {
+    native::advanceMillis(1);
+    sink = scaleStatusStep();
+  }));
+  TEST_ASSERT_TRUE(scaleReady);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_benchmark_math_buffer);
+  RUN_TEST(test_benchmark_sample_path);
+  return UNITY_END();
+}
@@ -0,0 +1,38 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <MathBuffer.h>
+#include <CreepModel.h>
+#include <cmath>
+
+void setUp() {}
+void tearDown() {}
+
+void test_creep_model_predicts_and_learns() {
+  // 300 mg of creep with a 2 s time constant, sampled every 10 ms for the first half second
+  static MathBuffer<int32_t, 100> buffer;
+  int64_t stepAtMs = (int64_t)millis();
+  for (int i = 0; i < 50; i++) {
+    native::advanceMillis(10);
+    int64_t t = (int64_t)millis() - stepAtMs;
+    buffer.push((int32_t)lround(50000 - 300 * exp(-t / 2000.0)));
+  }
+
+  CreepModel model(2000);
+  int32_t settled = 0;
+  TEST_ASSERT_TRUE(model.predictSettled(buffer.begin(), buffer.end(), stepAtMs, settled));
+  TEST_ASSERT_INT32_WITHIN(5, 50000, settled);
+  TEST_ASSERT_FALSE(model.predictSettled(buffer.begin(), buffer.begin() + 3, stepAtMs, settled));
+
+  // Averages a second apart along the same settle pull a wrong guess towards 2 s
+  CreepModel learning(500);
+  auto at = [](double t) { return (int32_t)lround(50000 - 3000 * exp(-t / 2000.0)); };
+  TEST_ASSERT_TRUE(learning.learn(at(0), at(1000), at(2000), 1000));
+  TEST_ASSERT_INT_WITHIN(10, 500 + (2000 - 500) / 4, learning.getTimeConstant());
+  TEST_ASSERT_FALSE(learning.learn(50000, 50005, 50010, 1000)); // flat, nothing to learn
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_creep_model_predicts_and_learns);
+  return UNITY_END();
+}
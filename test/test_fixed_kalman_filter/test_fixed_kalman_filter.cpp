@@ -0,0 +1,35 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <FixedKalmanFilter.h>
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t lcg = 12345;
+static int32_t randomValue(int32_t range) {
+  lcg = lcg * 1103515245 + 12345;
+  return (int32_t)((lcg >> 8) % (2 * range + 1)) - range;
+}
+
+void test_fixed_kalman_filter_converges() {
+  FixedKalmanFilter filter(20, 20, FIXED_Q16(0.01));
+  for (int i = 0; i < 200; i++) {
+    filter.updateEstimate(5000 + randomValue(20));
+  }
+  TEST_ASSERT_INT32_WITHIN(30, 5000, filter.getEstimate());
+
+  // A long quiet stretch must not freeze the filter
+  for (int i = 0; i < 20000; i++) {
+    filter.updateEstimate(5000);
+  }
+  for (int i = 0; i < 50; i++) {
+    filter.updateEstimate(25000);
+  }
+  TEST_ASSERT_INT32_WITHIN(500, 25000, filter.getEstimate());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_fixed_kalman_filter_converges);
+  return UNITY_END();
+}
@@ -0,0 +1,45 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <HampelFilter.h>
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t lcg = 12345;
+static int32_t randomValue(int32_t range) {
+  lcg = lcg * 1103515245 + 12345;
+  return (int32_t)((lcg >> 8) % (2 * range + 1)) - range;
+}
+
+void test_hampel_filter_rejects_spikes_only() {
+  HampelFilter<int32_t, 5> filter(300);
+  for (int i = 0; i < 20; i++) {
+    filter.filter(10000 + randomValue(20));
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, filter.rejectedCount());
+
+  // A lone spike is replaced by the median
+  TEST_ASSERT_INT32_WITHIN(20, 10000, filter.filter(30000));
+  TEST_ASSERT_TRUE(filter.lastRejected());
+  TEST_ASSERT_INT32_WITHIN(20, 10000, filter.filter(10000));
+  TEST_ASSERT_FALSE(filter.lastRejected());
+
+  // A real step is held back for one reading only
+  TEST_ASSERT_INT32_WITHIN(20, 10000, filter.filter(50000));
+  TEST_ASSERT_EQUAL_INT32(50000, filter.filter(50000));
+  TEST_ASSERT_EQUAL_UINT32(2, filter.rejectedCount());
+
+  // A steady ramp passes untouched
+  filter.resetRejectedCount();
+  for (int i = 0; i < 200; i++) {
+    int32_t value = 50000 + 24 * i + randomValue(20);
+    TEST_ASSERT_EQUAL_INT32(value, filter.filter(value));
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, filter.rejectedCount());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_hampel_filter_rejects_spikes_only);
+  return UNITY_END();
+}
@@ -0,0 +1,145 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <MathBuffer.h>
+#include <ConcurrentBuffer.h>
+#include <TieredHistory.h>
+#include <algorithm>
+#include <deque>
+#include <numeric>
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t lcg = 12345;
+static int32_t randomValue(int32_t range) {
+  lcg = lcg * 1103515245 + 12345;
+  return (int32_t)((lcg >> 8) % (2 * range + 1)) - range;
+}
+
+// Compares every window query against a brute force scan of the same samples
+void test_window_queries_match_brute_force() {
+  MathBuffer<int32_t, 17> buffer;
+  std::deque<std::pair<int32_t, int64_t>> reference;
+
+  for (int i = 0; i < 2000; i++) {
+    native::advanceMillis((lcg >> 4) % 3);
+    int32_t value = randomValue(1000);
+    buffer.push(value);
+    reference.push_back({value, (int64_t)millis()});
+    if (reference.size() > 17) {
+      reference.pop_front();
+    }
+
+    for (int windowMs = 0; windowMs < 50; windowMs += 7) {
+      int64_t cutoff = (int64_t)millis() - windowMs;
+      int64_t sum = 0;
+      size_t count = 0;
+      int32_t max = 0, min = 0, older = 0;
+      for (auto it = reference.rbegin(); it != reference.rend(); ++it) {
+        if (it->second < cutoff) {
+          older = it->first;
+          break;
+        }
+        max = count == 0 ? it->first : std::max(max, it->first);
+        min = count == 0 ? it->first : std::min(min, it->first);
+        sum += it->first;
+        count++;
+      }
+
+      TEST_ASSERT_EQUAL(count, buffer.countSamplesSince(cutoff));
+      TEST_ASSERT_EQUAL_INT32(count ? (int32_t)(sum / (int64_t)count) : 0, buffer.averageSince(cutoff));
+      TEST_ASSERT_EQUAL_INT32(max, buffer.maxSince(cutoff));
+      TEST_ASSERT_EQUAL_INT32(min, buffer.minSince(cutoff));
+      TEST_ASSERT_EQUAL_INT32(older, buffer.firstValueOlderThan(cutoff));
+    }
+  }
+}
+
+void test_window_iterators_work_with_algorithms() {
+  MathBuffer<int32_t, 10> buffer;
+  for (int i = 0; i < 25; i++) {
+    native::advanceMillis(10);
+    buffer.push(i % 7);
+  }
+
+  auto window = buffer.since((int64_t)millis() - 45); // last five samples: 6 0 1 2 3
+  TEST_ASSERT_EQUAL(5, window.size());
+  TEST_ASSERT_EQUAL_INT32(6, *std::max_element(window.begin(), window.end()));
+  TEST_ASSERT_EQUAL_INT32(12, std::accumulate(window.begin(), window.end(), 0));
+  TEST_ASSERT_EQUAL_INT32(3, *window.rbegin());
+  TEST_ASSERT_EQUAL_INT32(6, window.begin()[0]);
+  TEST_ASSERT_EQUAL((int64_t)millis(), (window.end() - 1).timestamp());
+  TEST_ASSERT_EQUAL(10, buffer.end() - buffer.begin());
+}
+
+void test_capture_timestamps_survive_rebasing() {
+  MathBuffer<int32_t, 8> buffer;
+  // Irregular capture times spanning well past the 32-bit microsecond range
+  int64_t timestampUs = 5000000000LL;
+  for (int i = 0; i < 40; i++) {
+    timestampUs += i % 5 == 0 ? 1500000000LL : 1250;
+    buffer.push(i, timestampUs);
+  }
+
+  TEST_ASSERT_EQUAL(timestampUs, (buffer.end() - 1).timestampUs());
+  TEST_ASSERT_EQUAL(timestampUs - 1250, (buffer.end() - 2).timestampUs());
+  // 1.3 ms back only reaches the previous sample, despite the sub-millisecond spacing
+  TEST_ASSERT_EQUAL(2, buffer.since((timestampUs - 1300) / 1000).size());
+  TEST_ASSERT_EQUAL_INT32(38, buffer.minSince((timestampUs - 1300) / 1000));
+  TEST_ASSERT_EQUAL_INT32(34, buffer.firstValueOlderThan((timestampUs - 1000000) / 1000));
+}
+
+void test_concurrent_buffer_forwards_queries() {
+  static ConcurrentMathBuffer<int32_t, 8> buffer;
+  for (int i = 1; i <= 4; i++) {
+    native::advanceMillis(10);
+    buffer.push(i * 100);
+  }
+
+  TEST_ASSERT_EQUAL_INT32(250, buffer.averageSince(0));
+  int32_t spread = buffer.read([](const MathBuffer<int32_t, 8> &b) { return b.maxSince(0) - b.minSince(0); });
+  TEST_ASSERT_EQUAL_INT32(300, spread);
+}
+
+void test_tiered_history_reaches_past_the_raw_ring() {
+  static TieredHistory<int32_t, 20, 60, 60> history;
+  // 10 samples per second: 30 s at 1 g, then 30 s at 3 g
+  for (int i = 0; i < 600; i++) {
+    native::advanceMillis(100);
+    history.push(i < 300 ? 1000 : 3000);
+  }
+
+  int64_t now = millis();
+  TEST_ASSERT_EQUAL_INT32(3000, history.averageSince(now - 1000));    // raw samples
+  TEST_ASSERT_INT32_WITHIN(100, 3000, history.averageSince(now - 20000)); // 1 s buckets
+  TEST_ASSERT_INT32_WITHIN(100, 2000, history.averageSince(now - 60000));
+  TEST_ASSERT_EQUAL_INT32(1000, history.minSince(now - 45000));
+  TEST_ASSERT_EQUAL_INT32(3000, history.maxSince(now - 45000));
+}
+
+void test_history_tier_leaves_out_buckets_before_the_cutoff() {
+  static HistoryTier<int32_t, 10, 1000> tier;
+  // One bucket of 1 g samples 100 ms apart, closed by a 3 g sample 600 ms after its last one
+  for (int i = 0; i < 10; i++) {
+    tier.add(1000, 1000000 + i * 100000);
+  }
+  tier.add(3000, 2500000);
+
+  // Cutoff after the closed bucket's last sample, before the sample that closed it
+  TEST_ASSERT_EQUAL(1, tier.countSamplesSince(1950));
+  TEST_ASSERT_EQUAL_INT32(3000, tier.averageSince(1950));
+  TEST_ASSERT_EQUAL_INT32(3000, tier.minSince(1950));
+  TEST_ASSERT_EQUAL_INT32(1000, tier.firstValueOlderThan(1950));
+  TEST_ASSERT_EQUAL(11, tier.countSamplesSince(1900));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_window_queries_match_brute_force);
+  RUN_TEST(test_window_iterators_work_with_algorithms);
+  RUN_TEST(test_capture_timestamps_survive_rebasing);
+  RUN_TEST(test_concurrent_buffer_forwards_queries);
+  RUN_TEST(test_tiered_history_reaches_past_the_raw_ring);
+  RUN_TEST(test_history_tier_leaves_out_buckets_before_the_cutoff);
+  return UNITY_END();
+}
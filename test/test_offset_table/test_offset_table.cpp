@@ -0,0 +1,45 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <OffsetTable.h>
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t lcg = 12345;
+static int32_t randomValue(int32_t range) {
+  lcg = lcg * 1103515245 + 12345;
+  return (int32_t)((lcg >> 8) % (2 * range + 1)) - range;
+}
+
+void test_offset_table_learns_each_dose_separately() {
+  OffsetTable<4, 3> table(10000, 5000, 5000, 5000); // 10-25 g, 5-15 s
+  TEST_ASSERT_EQUAL_INT32(0, table.lookup(17500, 7500));
+
+  // A first shot lands exactly and stands in everywhere nothing is known yet
+  table.learn(15000, 8000, -1200);
+  TEST_ASSERT_EQUAL_INT32(-1200, table.lookup(15000, 8000));
+  TEST_ASSERT_EQUAL_INT32(-1200, table.lookup(25000, 15000));
+
+  // Another dose learns its own offset without moving the first one
+  for (int shot = 0; shot < 5; shot++) {
+    table.learn(20000, 12000, -2000 - table.lookup(20000, 12000) + randomValue(20));
+  }
+  TEST_ASSERT_INT32_WITHIN(20, -2000, table.lookup(20000, 12000));
+  TEST_ASSERT_EQUAL_INT32(-1200, table.lookup(15000, 8000));
+  TEST_ASSERT_EQUAL_UINT32(0, table.shotsAt(0, 0));
+  TEST_ASSERT_TRUE(table.shotsAt(2, 1) > 0);
+
+  // In between the two, and past the edges
+  int32_t between = table.lookup(17500, 10000);
+  TEST_ASSERT_TRUE(between < -1200 && between > -2000);
+  TEST_ASSERT_EQUAL_INT32(table.lookup(25000, 15000), table.lookup(40000, 60000));
+
+  table.clear();
+  TEST_ASSERT_EQUAL_INT32(0, table.lookup(20000, 12000));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_offset_table_learns_each_dose_separately);
+  return UNITY_END();
+}
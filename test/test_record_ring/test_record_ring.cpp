@@ -0,0 +1,148 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <RecordRing.h>
+#include <cstring>
+#include <vector>
+
+void setUp() {}
+void tearDown() {}
+
+// Byte array standing in for the shot log file
+struct MemoryStorage {
+  std::vector<uint8_t> bytes;
+  explicit MemoryStorage(size_t size) : bytes(size, 0) {}
+  bool read(size_t offset, void *data, size_t length) {
+    memcpy(data, &bytes[offset], length);
+    return true;
+  }
+  bool write(size_t offset, const void *data, size_t length) {
+    memcpy(&bytes[offset], data, length);
+    return true;
+  }
+};
+
+// Segment files that, like the shot log's, only ever grow or start over
+struct SegmentStorage {
+  std::vector<std::vector<uint8_t>> segments;
+  size_t segmentBytes;
+  int inPlaceWrites = 0;
+  bool failNextWrite = false;
+  SegmentStorage(size_t count, size_t bytes) : segments(count), segmentBytes(bytes) {}
+  bool read(size_t offset, void *data, size_t length) {
+    std::vector<uint8_t> &segment = segments[offset / segmentBytes];
+    size_t at = offset % segmentBytes;
+    if (at + length > segment.size()) {
+      return false;
+    }
+    memcpy(data, &segment[at], length);
+    return true;
+  }
+  bool write(size_t offset, const void *data, size_t length) {
+    std::vector<uint8_t> &segment = segments[offset / segmentBytes];
+    size_t at = offset % segmentBytes;
+    if (at == 0) {
+      segment.clear();
+    }
+    inPlaceWrites += segment.size() != at;
+    if (failNextWrite) {
+      failNextWrite = false;
+      return false;
+    }
+    segment.resize(at);
+    segment.insert(segment.end(), (const uint8_t *)data, (const uint8_t *)data + length);
+    return true;
+  }
+};
+
+void test_record_ring_finds_its_head_after_a_reset() {
+  using Ring = RecordRing<int32_t, 32, 8, MemoryStorage>;
+  MemoryStorage storage(Ring::bytes());
+  Ring ring(storage);
+  ring.load();
+  TEST_ASSERT_EQUAL_UINT32(1, ring.nextSequence());
+
+  for (int32_t record = 1; record <= 100; record++) {
+    TEST_ASSERT_TRUE(ring.append(record * 10));
+  }
+
+  // A fresh ring over the same storage picks up where the old one stopped
+  Ring reloaded(storage);
+  reloaded.load();
+  TEST_ASSERT_EQUAL_UINT32(101, reloaded.nextSequence());
+  TEST_ASSERT_EQUAL_UINT32(69, reloaded.oldestSequence());
+
+  int32_t records[8];
+  TEST_ASSERT_EQUAL_UINT32(5, reloaded.read(96, records, 8));
+  for (int i = 0; i < 5; i++) {
+    TEST_ASSERT_EQUAL_INT32((96 + i) * 10, records[i]);
+  }
+  // Overwritten records are gone, the oldest one left is 69
+  TEST_ASSERT_EQUAL_UINT32(0, reloaded.read(1, records, 8));
+  TEST_ASSERT_EQUAL_UINT32(3, reloaded.read(64, records, 8));
+  TEST_ASSERT_EQUAL_INT32(690, records[0]);
+
+  // A reset in the middle of writing record 101 leaves a torn slot that doesn't count
+  reloaded.append(1010);
+  storage.bytes[4 * (Ring::bytes() / 32) + 5] ^= 0xff; // record 101 went into slot 4
+  Ring torn(storage);
+  torn.load();
+  TEST_ASSERT_EQUAL_UINT32(101, torn.nextSequence());
+  TEST_ASSERT_EQUAL_UINT32(0, torn.read(101, records, 8));
+  torn.append(1011);
+  TEST_ASSERT_EQUAL_UINT32(1, torn.read(101, records, 8));
+  TEST_ASSERT_EQUAL_INT32(1011, records[0]);
+
+  // A damaged record doesn't hide the ones after it
+  storage.bytes[10 * (Ring::bytes() / 32) + 5] ^= 0xff; // record 75
+  TEST_ASSERT_EQUAL_UINT32(7, torn.read(72, records, 8));
+  TEST_ASSERT_EQUAL_INT32(740, records[2]);
+  TEST_ASSERT_EQUAL_INT32(760, records[3]);
+}
+
+void test_record_ring_over_segments_only_appends() {
+  using Ring = RecordRing<int32_t, 32, 8, SegmentStorage>;
+  SegmentStorage storage(4, 8 * Ring::slotBytes());
+  Ring ring(storage);
+  ring.load();
+  for (int32_t record = 1; record <= 100; record++) {
+    TEST_ASSERT_TRUE(ring.append(record * 10));
+  }
+  TEST_ASSERT_EQUAL(0, storage.inPlaceWrites);
+
+  // Record 97 started the first segment over, so 73 is the oldest one left
+  Ring reloaded(storage);
+  reloaded.load();
+  TEST_ASSERT_EQUAL_UINT32(101, reloaded.nextSequence());
+  int32_t records[8];
+  TEST_ASSERT_EQUAL_UINT32(4, reloaded.read(69, records, 8));
+  TEST_ASSERT_EQUAL_INT32(730, records[0]);
+  TEST_ASSERT_EQUAL_UINT32(4, reloaded.read(97, records, 8));
+  TEST_ASSERT_EQUAL_INT32(1000, records[3]);
+
+  // Appends go on after the newest record found
+  TEST_ASSERT_TRUE(reloaded.append(1010));
+  TEST_ASSERT_EQUAL(0, storage.inPlaceWrites);
+
+  // A reset just after a segment was started over takes its records with it, the ring
+  // carries on from the newest one left
+  for (int32_t record = 102; record <= 128; record++) {
+    TEST_ASSERT_TRUE(reloaded.append(record * 10));
+  }
+  storage.failNextWrite = true;
+  TEST_ASSERT_FALSE(reloaded.append(1290));
+  Ring restarted(storage);
+  restarted.load();
+  TEST_ASSERT_EQUAL_UINT32(129, restarted.nextSequence());
+  TEST_ASSERT_EQUAL_UINT32(0, restarted.read(97, records, 8));
+  TEST_ASSERT_TRUE(restarted.append(1290));
+  TEST_ASSERT_EQUAL_UINT32(1, restarted.read(129, records, 8));
+  TEST_ASSERT_EQUAL_INT32(1290, records[0]);
+  TEST_ASSERT_EQUAL(0, storage.inPlaceWrites);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_record_ring_finds_its_head_after_a_reset);
+  RUN_TEST(test_record_ring_over_segments_only_appends);
+  return UNITY_END();
+}
@@ -0,0 +1,158 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <esp_timer.h>
+#include <Replay.h>
+#include <stdlib.h>
+#include "config.hpp"
+#include "scale.hpp"
+#include "recorder.hpp"
+
+// One HX711 conversion at 80 SPS
+#define SAMPLE_PERIOD_MS 12
+
+static uint32_t noiseState = 1;
+static int32_t noise() {
+  noiseState = noiseState * 1103515245 + 12345;
+  return (int32_t)((noiseState >> 16) % 41) - 20;
+}
+
+// Weight on the scale during a typical cup-triggered shot, t in ms
+static int32_t shotWeight(uint32_t t) {
+  if (t < 2000) return 0;                               // empty
+  if (t < 3500) return 70000;                           // cup placed
+  if (t < 11000) return 70000 + (t - 3500) * 2;         // grinding at 2 g/s
+  if (t < 15000) return 85000 + 1500;                   // last grounds land
+  return 0;                                             // cup taken away
+}
+
+void setUp() {
+  Preferences::clearAll();
+  setScaleFactor(MG_PER_GRAM); // one count per milligram
+  setCupWeight = 70000;
+  setWeight = 18000;
+  offset = -2500;
+  grindMode = false;
+  scaleMode = false;
+  useButtonToGrind = false;
+  topUpMode = false;
+  offsetTable.clear();
+  clearRecording();
+}
+
+void tearDown() {
+  native::serialCapture = nullptr;
+}
+
+// Raw counts of the empty scale, and how far they move per degree of chip temperature
+#define EMPTY_COUNTS 300000
+#define COUNTS_PER_DEGREE 200
+
+// Records a shot the way updateScale does, dumps it over serial and replays the dump.
+// A 5 g tray goes on the empty scale and is tared away, and the chip warms by 3 degrees.
+void test_dump_replays_deterministically() {
+  stopDelayMs = 400; // 0.8 g still in flight at the stop
+  scaleZeroCounts = EMPTY_COUNTS;
+  driftCountsPerDegree = COUNTS_PER_DEGREE;
+  float celsius = 25;
+  for (uint32_t t = 0; t < 17000; t += SAMPLE_PERIOD_MS) {
+    native::advanceMillis(SAMPLE_PERIOD_MS);
+    int64_t readyAtUs = esp_timer_get_time();
+    if (t % 1000 < SAMPLE_PERIOD_MS) {
+      celsius = 25 + t / 5000.0f;
+      processTemperatureReading(celsius);
+      recordTemperature(celsius, readyAtUs);
+    }
+    if (t == 1200) {
+      tareScale();
+    }
+    int32_t tray = t >= 600 ? 5000 : 0;
+    int32_t drift = (int32_t)lround(COUNTS_PER_DEGREE * (celsius - 25));
+    recordRawSample(EMPTY_COUNTS + tray + drift + shotWeight(t) + noise(), readyAtUs);
+  }
+  tarePending = false;
+  TEST_ASSERT_EQUAL(17000 / SAMPLE_PERIOD_MS + 1, recordedSampleCount());
+
+  std::string dump;
+  native::serialCapture = &dump;
+  dumpRecording();
+  native::serialCapture = nullptr;
+
+  native::Recording recording;
+  TEST_ASSERT_TRUE(native::parseRecording("boot noise\n" + dump, recording));
+  TEST_ASSERT_EQUAL(recordedSampleCount(), recording.readings.size());
+  TEST_ASSERT_EQUAL(-2500, recording.offset);
+  TEST_ASSERT_EQUAL(0u, recording.readings.front().offsetUs);
+  TEST_ASSERT_EQUAL(SAMPLE_PERIOD_MS * 1000, recording.readings[1].offsetUs);
+  // Raw counts, with the zero the first sample was read against and the events after it
+  TEST_ASSERT_TRUE(recording.raw);
+  TEST_ASSERT_EQUAL(EMPTY_COUNTS, recording.zeroCounts);
+  TEST_ASSERT_INT32_WITHIN(20, EMPTY_COUNTS, recording.readings.front().counts);
+  TEST_ASSERT_EQUAL(17, recording.events.size()); // a temperature a second after the first, one tare
+
+  // Have the relay timer make the stop on purpose: a first replay finds where between two
+  // readings the stop lands, then the stop delay moves it halfway between them
+  uint32_t periodUs = recording.readings[1].offsetUs - recording.readings[0].offsetUs;
+  native::ReplayResult probe = native::replay(recording);
+  TEST_ASSERT_TRUE(probe.stoppedAtUs >= 0);
+  int32_t shiftUs = (int32_t)(probe.stoppedAtUs % periodUs) - (int32_t)(periodUs / 2);
+  recording.stopDelayMs += shiftUs / 1000; // in flight at 2 g/s, a longer delay stops sooner
+
+  resetTransitionStats();
+  native::ReplayResult first = native::replay(recording);
+  // The relay timer made the stop in between two readings, as on the device
+  TEST_ASSERT_EQUAL_UINT32(1, transitionStats(STATUS_GRINDING_IN_PROGRESS, STATUS_GRINDING_FINISHED).count);
+  TEST_ASSERT_EQUAL_UINT32(EVENT_TIMEOUT, transitionStats(STATUS_GRINDING_IN_PROGRESS, STATUS_GRINDING_FINISHED).lastEvent);
+  TEST_ASSERT_TRUE(first.stoppedAtUs % periodUs != 0);
+  offset = recording.offset;
+  native::ReplayResult second = native::replay(recording);
+
+  // Cup detected, grinder stopped at the target, offset corrected, cup removed
+  TEST_ASSERT_EQUAL(3, first.statusChanges.size());
+  TEST_ASSERT_EQUAL(STATUS_GRINDING_IN_PROGRESS, first.statusChanges[0].to);
+  TEST_ASSERT_EQUAL(STATUS_GRINDING_FINISHED, first.statusChanges[1].to);
+  // Stopped within a couple of readings of the target less what is in flight (2 g/s is 24 mg a reading), not on a later poll
+  int32_t overshoot = first.statusChanges[1].weight - (cupWeightEmpty + 18000 - 2500 - 2 * (int32_t)recording.stopDelayMs);
+  TEST_ASSERT_TRUE(overshoot >= 0 && overshoot <= 3 * 2 * SAMPLE_PERIOD_MS);
+  TEST_ASSERT_EQUAL(STATUS_EMPTY, first.statusChanges[2].to);
+  // The tray was tared away before the cup came, and the drift taken off while grinding
+  TEST_ASSERT_INT32_WITHIN(100, 70000, first.statusChanges[0].weight);
+  TEST_ASSERT_INT32_WITHIN(100, EMPTY_COUNTS + 5000, scaleZeroCounts);
+  TEST_ASSERT_EQUAL(1u, first.shots);
+  TEST_ASSERT_TRUE(first.finalOffset != -2500);
+
+  TEST_ASSERT_EQUAL(first.statusChanges.size(), second.statusChanges.size());
+  for (size_t i = 0; i < first.statusChanges.size(); i++) {
+    TEST_ASSERT_EQUAL(first.statusChanges[i].atMs, second.statusChanges[i].atMs);
+    TEST_ASSERT_EQUAL(first.statusChanges[i].to, second.statusChanges[i].to);
+    TEST_ASSERT_EQUAL(first.statusChanges[i].weight, second.statusChanges[i].weight);
+  }
+  TEST_ASSERT_EQUAL(first.finalOffset, second.finalOffset);
+}
+
+// Replays a dump captured on a device: OPENGBW_RECORDING=shot.txt pio test -e native -f test_replay
+void test_replay_recording_from_environment() {
+  const char *path = getenv("OPENGBW_RECORDING");
+  if (path == nullptr) {
+    TEST_IGNORE_MESSAGE("set OPENGBW_RECORDING to replay a recorded dump");
+  }
+  native::Recording recording;
+  TEST_ASSERT_TRUE_MESSAGE(native::loadRecording(path, recording), "not a readable recording");
+
+  native::ReplayResult result = native::replay(recording);
+  char message[96];
+  for (const native::StatusChange &change : result.statusChanges) {
+    snprintf(message, sizeof(message), "%6lu ms: status %d -> %d at %.1f g",
+             (unsigned long)change.atMs, change.from, change.to, mgToGrams(change.weight));
+    TEST_MESSAGE(message);
+  }
+  snprintf(message, sizeof(message), "offset %.2f g -> %.2f g, %u shots",
+           mgToGrams(recording.offset), mgToGrams(result.finalOffset), result.shots);
+  TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_dump_replays_deterministically);
+  RUN_TEST(test_replay_recording_from_environment);
+  return UNITY_END();
+}
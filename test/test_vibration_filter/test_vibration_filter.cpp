@@ -0,0 +1,63 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <FixedKalmanFilter.h>
+#include <SpectrumEstimator.h>
+#include <BiquadNotch.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+void setUp() {}
+void tearDown() {}
+
+static uint32_t lcg = 12345;
+static int32_t randomValue(int32_t range) {
+  lcg = lcg * 1103515245 + 12345;
+  return (int32_t)((lcg >> 8) % (2 * range + 1)) - range;
+}
+
+void test_spectrum_finds_a_line_over_a_ramp() {
+  // 400 mg at 0.21 cycles per reading on top of a steep ramp
+  static SpectrumEstimator<64> spectrum(4, 10, 50);
+  bool found = false;
+  for (int i = 0; i < 200; i++) {
+    int32_t value = 20 * i + (int32_t)lround(400 * sin(2 * M_PI * 0.21 * i)) + randomValue(20);
+    if (spectrum.push(value)) {
+      found = spectrum.hasPeak();
+    }
+  }
+  TEST_ASSERT_TRUE(found);
+  TEST_ASSERT_INT_WITHIN(FIXED_Q16(0.005), FIXED_Q16(0.21), spectrum.peakFrequencyQ16());
+  TEST_ASSERT_INT32_WITHIN(80, 400, spectrum.peakAmplitude());
+
+  // Noise alone has no line worth notching
+  spectrum.reset();
+  for (int i = 0; i < 200; i++) {
+    if (spectrum.push(20 * i + randomValue(20))) {
+      TEST_ASSERT_FALSE(spectrum.hasPeak());
+    }
+  }
+}
+
+void test_notch_removes_the_line_and_passes_the_weight() {
+  BiquadNotch notch;
+  TEST_ASSERT_EQUAL_INT32(1234, notch.filter(1234)); // off until tuned
+  notch.tune(FIXED_Q16(0.21), FIXED_Q16(0.9));
+
+  int32_t worst = 0;
+  for (int i = 0; i < 400; i++) {
+    int32_t weight = 50000 + 20 * i;
+    int32_t output = notch.filter(weight + (int32_t)lround(400 * sin(2 * M_PI * 0.21 * i)));
+    if (i >= 100) {
+      worst = std::max(worst, std::abs(output - weight));
+    }
+  }
+  TEST_ASSERT_LESS_THAN(40, worst);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_spectrum_finds_a_line_over_a_ramp);
+  RUN_TEST(test_notch_removes_the_line_and_passes_the_weight);
+  return UNITY_END();
+}